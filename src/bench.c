@@ -0,0 +1,519 @@
+// Benchmarks for the editor core, built from dave_ed.c without its main and
+// run without a terminal. Each benchmark runs in a fresh process, a few
+// times over, and the best run is reported as one JSON object; together
+// they go to stdout as a JSON array.
+//
+// Usage: DaveEdBench [-n LINES] [-b BASELINE] [FILE]
+// FILE is a real source to open and highlight (make bench uses test.txt);
+// the rest run on a generated C file of LINES lines. BASELINE is the output
+// of an earlier run; results it also has get its time and the ratio of the
+// two added, above 1 being slower now.
+#define DAVE_ED_NO_MAIN
+#include "dave_ed.c"
+
+#include <sys/wait.h>
+
+#define BENCH_RUNS      3
+#define BENCH_EDITS     10000
+#define BENCH_FRAMES    2000
+#define BENCH_LONG_KEYS 1000
+#define BENCH_BUFFERS   1000
+
+struct Bench {
+	char *name;
+	char *file;
+	long long (*run)(void);
+};
+
+char bench_dir[] = "/tmp/DaveEdBench.XXXXXX";
+char *bench_source;
+char *bench_generated;
+char *bench_file;
+int bench_lines = 1000000;
+
+#define BENCH_BASELINES 64
+
+struct {
+	char name[64];
+	double ns_per_op;
+} bench_baselines[BENCH_BASELINES];
+int bench_num_baselines;
+
+long long bench_now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// A block of C with a bit of everything the highlighter looks at.
+void bench_generate(char *path, int lines) {
+	FILE *file_pointer = fopen(path, "w");
+	if (!file_pointer) die("fopen");
+
+	for (int k = 0; k < lines; k++) {
+		int block = k / 10;
+		switch (k % 10) {
+			case 0: fprintf(file_pointer, "/* block %d: generated for benchmarking */\n", block); break;
+			case 1: fprintf(file_pointer, "static int value_%d = %d;\n", block, block * 7); break;
+			case 2: fprintf(file_pointer, "int function_%d(int x, char *s) {\n", block); break;
+			case 3: fprintf(file_pointer, "\t// add up the counts\n"); break;
+			case 4: fprintf(file_pointer, "\tif (x > 42 && s[0] == 'a') return x * 3.5;\n"); break;
+			case 5: fprintf(file_pointer, "\tfor (int i = 0; i < x; i++) printf(\"%%d items\\n\", i);\n"); break;
+			case 6: fprintf(file_pointer, "\t/* a comment\n"); break;
+			case 7: fprintf(file_pointer, "\t   over two lines */\n"); break;
+			case 8: fprintf(file_pointer, "\treturn value_%d;\n", block); break;
+			case 9: fprintf(file_pointer, "}\n"); break;
+		}
+	}
+
+	fclose(file_pointer);
+}
+
+// The benchmarks. Each returns the number of operations it timed, with
+// the time they took accumulated in bench_elapsed.
+long long bench_elapsed;
+long long bench_start;
+volatile long long bench_sink;
+
+#define BENCH_BEGIN()  (bench_start = bench_now_ns())
+#define BENCH_END()    (bench_elapsed += bench_now_ns() - bench_start)
+
+// Edits made here are thrown away, so they are not journaled.
+void bench_load() {
+	editor_open(bench_file);
+	Ed.buffer -> journal.suspended = 1;
+}
+
+long long bench_open() {
+	BENCH_BEGIN();
+	bench_load();
+	BENCH_END();
+
+	return 1;
+}
+
+long long bench_insert_rows(int where) {
+	char line[] = "\tint inserted = value_0 + 1; // a new row";
+	bench_load();
+
+	BENCH_BEGIN();
+	for (int k = 0; k < BENCH_EDITS; k++) {
+		int at = where == 0 ? 0 : where == 1 ? Ed.buffer -> num_rows / 2 : Ed.buffer -> num_rows;
+		editor_insert_row(at, line, sizeof(line) - 1);
+	}
+	BENCH_END();
+
+	return BENCH_EDITS;
+}
+
+long long bench_delete_rows(int where) {
+	bench_load();
+
+	BENCH_BEGIN();
+	for (int k = 0; k < BENCH_EDITS; k++) {
+		int at = where == 0 ? 0 : where == 1 ? Ed.buffer -> num_rows / 2 : Ed.buffer -> num_rows - 1;
+		editor_delete_row(at);
+	}
+	BENCH_END();
+
+	return BENCH_EDITS;
+}
+
+long long bench_insert_head() { return bench_insert_rows(0); }
+long long bench_insert_middle() { return bench_insert_rows(1); }
+long long bench_insert_tail() { return bench_insert_rows(2); }
+long long bench_delete_head() { return bench_delete_rows(0); }
+long long bench_delete_middle() { return bench_delete_rows(1); }
+long long bench_delete_tail() { return bench_delete_rows(2); }
+
+// Keys go through editor_process_key, undo groups and all, with a line
+// break every so often so rows stay a normal length.
+long long bench_type() {
+	bench_load();
+	Ed.view.cy = Ed.buffer -> num_rows / 2;
+
+	BENCH_BEGIN();
+	for (int k = 0; k < BENCH_EDITS; k++)
+		editor_process_key(k % 60 == 59 ? '\r' : 'a' + k % 26);
+	BENCH_END();
+
+	return BENCH_EDITS;
+}
+
+// Renders and highlights every row, dropping each again so memory stays
+// flat on big files.
+long long bench_highlight() {
+	bench_load();
+
+	BENCH_BEGIN();
+	editor_syntax_settle(Ed.buffer -> num_rows);
+	for (int at = 0; at < Ed.buffer -> num_rows; at++) {
+		rstore *row = editor_row(at);
+		editor_row_prepare(row);
+		editor_render_cache_remove(row);
+		editor_row_evict(row);
+	}
+	BENCH_END();
+
+	return Ed.buffer -> num_rows;
+}
+
+// Whole frames, as after a clear screen, a page at a time.
+long long bench_draw_full() {
+	struct ABuf ab = ABUF_INIT;
+	bench_load();
+
+	BENCH_BEGIN();
+	for (int k = 0; k < BENCH_FRAMES; k++) {
+		Ed.view.row_offset = (long long) k * Ed.screen_rows % (Ed.buffer -> num_rows > 1 ? Ed.buffer -> num_rows : 1);
+		for (int y = 0; y < Ed.screen_rows; y++) Ed.screen_lines[y].len = 0;
+		ab.len = 0;
+		editor_draw_rows(&ab);
+		editor_render_cache_trim();
+	}
+	BENCH_END();
+
+	abuf_free(&ab);
+
+	return BENCH_FRAMES;
+}
+
+// Frames scrolling down a row at a time, which redraw only the new line.
+long long bench_draw_scroll() {
+	struct ABuf ab = ABUF_INIT;
+	bench_load();
+	editor_draw_rows(&ab);
+
+	BENCH_BEGIN();
+	for (int k = 1; k <= BENCH_FRAMES; k++) {
+		Ed.view.row_offset = k;
+		ab.len = 0;
+		editor_scroll_screen(&ab, 1);
+		editor_draw_rows(&ab);
+		editor_render_cache_trim();
+	}
+	BENCH_END();
+
+	abuf_free(&ab);
+
+	return BENCH_FRAMES;
+}
+
+// Cursor column conversions on a 10 MB line full of tabs, as editor_scroll
+// does on every frame.
+long long bench_columns_long_line() {
+	size_t len = 10 << 20;
+	char *line = malloc(len);
+	for (size_t k = 0; k < len; k++) line[k] = k % 9 == 0 ? '\t' : 'x';
+	editor_insert_row(0, line, len);
+	free(line);
+
+	rstore *row = editor_row(0);
+	BENCH_BEGIN();
+	for (int k = 0; k < BENCH_EDITS; k++) {
+		int cx = (long long) k * 7919 % row -> size;
+		bench_sink += editor_row_rx_to_cx(row, editor_row_cx_to_rx(row, cx));
+	}
+	BENCH_END();
+
+	return BENCH_EDITS;
+}
+
+// Short rows of C, plain ASCII or with accents and wide chars in them.
+void bench_short_rows(int utf8) {
+	char *text = utf8 ? "\tint v\xc3\xa4rde = 42; /* \xe6\xb3\xa8\xe6\x84\x8f */ s = \"gr\xc3\xbc\xc3\x9f\";"
+					  : "\tint value = 42; /* note */ s = \"hello\";";
+
+	Ed.buffer -> file_name = strdup("short.c");
+	editor_select_syntax_highlight();
+	for (int k = 0; k < BENCH_EDITS; k++) editor_insert_row(k, text, strlen(text));
+}
+
+// Cursor column conversions on short rows, the common case, to keep the
+// plain ASCII path honest next to the UTF-8 one.
+long long bench_columns_short(int utf8) {
+	bench_short_rows(utf8);
+
+	BENCH_BEGIN();
+	for (int k = 0; k < BENCH_EDITS; k++) {
+		rstore *row = editor_row(k);
+		for (int cx = 0; cx < row -> size; cx = editor_row_next_char(row, cx))
+			bench_sink += editor_row_rx_to_cx(row, editor_row_cx_to_rx(row, cx));
+	}
+	BENCH_END();
+
+	return BENCH_EDITS;
+}
+
+long long bench_columns_short_ascii() { return bench_columns_short(0); }
+long long bench_columns_short_utf8() { return bench_columns_short(1); }
+
+// Whole frames of short rows, rendered afresh each time.
+long long bench_draw_short(int utf8) {
+	struct ABuf ab = ABUF_INIT;
+	bench_short_rows(utf8);
+
+	BENCH_BEGIN();
+	for (int k = 0; k < BENCH_FRAMES; k++) {
+		Ed.view.row_offset = (long long) k * Ed.screen_rows % (Ed.buffer -> num_rows - Ed.screen_rows);
+		for (int y = 0; y < Ed.screen_rows; y++) Ed.screen_lines[y].len = 0;
+		ab.len = 0;
+		editor_draw_rows(&ab);
+		editor_render_cache_trim();
+	}
+	BENCH_END();
+
+	abuf_free(&ab);
+
+	return BENCH_FRAMES;
+}
+
+long long bench_draw_short_ascii() { return bench_draw_short(0); }
+long long bench_draw_short_utf8() { return bench_draw_short(1); }
+
+// Keys typed into the middle of a 16 MB line of C, with a frame drawn after
+// each, as when editing a minified file.
+long long bench_type_long_line() {
+	char text[] = "int x = 42; /* c */ s = \"str\";\t";
+	struct ABuf ab = ABUF_INIT;
+	size_t len = 16 << 20;
+	char *line = malloc(len);
+	for (size_t k = 0; k < len; k++) line[k] = text[k % (sizeof(text) - 1)];
+
+	Ed.buffer -> file_name = strdup("long.c");
+	editor_select_syntax_highlight();
+	editor_insert_row(0, line, len);
+	free(line);
+	Ed.view.cx = len / 2;
+	editor_scroll();
+	editor_draw_rows(&ab);
+
+	BENCH_BEGIN();
+	for (int k = 0; k < BENCH_LONG_KEYS; k++) {
+		editor_process_key('a' + k % 26);
+		ab.len = 0;
+		editor_scroll();
+		editor_draw_rows(&ab);
+	}
+	BENCH_END();
+
+	abuf_free(&ab);
+
+	return BENCH_LONG_KEYS;
+}
+
+long long bench_search(char *pattern, int regex) {
+	bench_load();
+
+	BENCH_BEGIN();
+	struct SearchJob *job = editor_search_start(pattern, 0, regex);
+	while (!editor_search_finished(job)) sched_yield();
+	editor_search_free(job);
+	BENCH_END();
+
+	return Ed.buffer -> num_rows;
+}
+
+// Opens many small files side by side, each shown once, the way a whole
+// source tree might be opened.
+long long bench_open_buffers() {
+	char path[sizeof(bench_dir) + 32];
+	for (int k = 0; k < BENCH_BUFFERS; k++) {
+		snprintf(path, sizeof(path), "%s/small_%d.c", bench_dir, k);
+		bench_generate(path, 40);
+	}
+
+	struct ABuf ab = ABUF_INIT;
+	BENCH_BEGIN();
+	for (int k = 0; k < BENCH_BUFFERS; k++) {
+		snprintf(path, sizeof(path), "%s/small_%d.c", bench_dir, k);
+		editor_open_buffer(path);
+		ab.len = 0;
+		editor_draw_rows(&ab);
+	}
+	BENCH_END();
+	abuf_free(&ab);
+
+	for (int k = 0; k < BENCH_BUFFERS; k++) {
+		snprintf(path, sizeof(path), "%s/small_%d.c", bench_dir, k);
+		unlink(path);
+	}
+
+	return BENCH_BUFFERS;
+}
+
+long long bench_search_literal() { return bench_search("items", 0); }
+long long bench_search_regex() { return bench_search("value_[0-9]*7;", 1); }
+
+long long bench_save() {
+	bench_load();
+	free(Ed.buffer -> file_name);
+
+	char path[sizeof(bench_dir) + 16];
+	snprintf(path, sizeof(path), "%s/saved.c", bench_dir);
+	Ed.buffer -> file_name = strdup(path);
+
+	BENCH_BEGIN();
+	editor_save();
+	BENCH_END();
+
+	unlink(path);
+
+	return Ed.buffer -> num_rows;
+}
+
+struct Bench benches[] = {
+	{ "open_source", NULL, bench_open },
+	{ "highlight_source", NULL, bench_highlight },
+	{ "open_generated", "", bench_open },
+	{ "insert_row_head", "", bench_insert_head },
+	{ "insert_row_middle", "", bench_insert_middle },
+	{ "insert_row_tail", "", bench_insert_tail },
+	{ "delete_row_head", "", bench_delete_head },
+	{ "delete_row_middle", "", bench_delete_middle },
+	{ "delete_row_tail", "", bench_delete_tail },
+	{ "type_characters", "", bench_type },
+	{ "highlight_generated", "", bench_highlight },
+	{ "draw_rows_full", "", bench_draw_full },
+	{ "draw_rows_scroll", "", bench_draw_scroll },
+	{ "columns_long_line", "", bench_columns_long_line },
+	{ "columns_short_ascii", "", bench_columns_short_ascii },
+	{ "columns_short_utf8", "", bench_columns_short_utf8 },
+	{ "draw_rows_ascii", "", bench_draw_short_ascii },
+	{ "draw_rows_utf8", "", bench_draw_short_utf8 },
+	{ "type_long_line", "", bench_type_long_line },
+	{ "search_literal", "", bench_search_literal },
+	{ "search_regex", "", bench_search_regex },
+	{ "save", "", bench_save },
+	{ "open_buffers", "", bench_open_buffers },
+};
+
+#define BENCHES  (sizeof(benches) / sizeof(benches[0]))
+
+// Picks the results out of an earlier run's output, which has one per line.
+void bench_load_baseline(char *path) {
+	FILE *file_pointer = fopen(path, "r");
+	if (!file_pointer) die("fopen");
+
+	char line[512];
+	while (fgets(line, sizeof(line), file_pointer) && bench_num_baselines < BENCH_BASELINES) {
+		char *name = strstr(line, "\"name\": \"");
+		char *ns = strstr(line, "\"ns_per_op\": ");
+		if (name == NULL || ns == NULL) continue;
+
+		if (sscanf(name, "\"name\": \"%63[^\"]\"", bench_baselines[bench_num_baselines].name) == 1 &&
+			sscanf(ns, "\"ns_per_op\": %lf", &bench_baselines[bench_num_baselines].ns_per_op) == 1)
+			bench_num_baselines++;
+	}
+
+	fclose(file_pointer);
+}
+
+double bench_baseline(char *name) {
+	for (int k = 0; k < bench_num_baselines; k++)
+		if (!strcmp(bench_baselines[k].name, name)) return bench_baselines[k].ns_per_op;
+
+	return 0;
+}
+
+// Runs one benchmark in a child, which sends back its timing over a pipe.
+int bench_run_once(struct Bench *bench, char *file, long long *ops, long long *elapsed) {
+	int fds[2];
+	if (pipe(fds) == -1) die("pipe");
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) die("fork");
+
+	if (pid == 0) {
+		close(fds[0]);
+		Ed.headless = 1;
+		init_editor();
+		editor_screen_resize();
+		bench_file = file;
+
+		long long result[2];
+		result[0] = bench -> run();
+		result[1] = bench_elapsed;
+		write(fds[1], result, sizeof(result));
+		_exit(0);
+	}
+
+	close(fds[1]);
+	long long result[2];
+	ssize_t got = read(fds[0], result, sizeof(result));
+	close(fds[0]);
+
+	int status;
+	waitpid(pid, &status, 0);
+	if (got != sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+
+	*ops = result[0];
+	*elapsed = result[1];
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+		if (opt == 'n') {
+			bench_lines = atoi(optarg);
+		} else if (opt == 'b') {
+			bench_load_baseline(optarg);
+		} else {
+			fprintf(stderr, "Usage: %s [-n LINES] [-b BASELINE] [FILE]\n", argv[0]);
+
+			return 1;
+		}
+	}
+
+	bench_source = optind < argc ? argv[optind] : NULL;
+	if (mkdtemp(bench_dir) == NULL) die("mkdtemp");
+
+	bench_generated = malloc(sizeof(bench_dir) + 16);
+	sprintf(bench_generated, "%s/generated.c", bench_dir);
+	bench_generate(bench_generated, bench_lines);
+
+	printf("{\n  \"version\": \"%s\",\n  \"lines\": %d,\n  \"runs\": %d,\n  \"results\": [", DAVE_ED_VERSION, bench_lines, BENCH_RUNS);
+
+	int first = 1, status = 0;
+	for (unsigned int k = 0; k < BENCHES; k++) {
+		char *file = benches[k].file ? bench_generated : bench_source;
+		if (file == NULL) continue;
+
+		long long ops = 0, best = -1;
+		for (int run = 0; run < BENCH_RUNS; run++) {
+			long long run_ops, elapsed;
+			if (bench_run_once(&benches[k], file, &run_ops, &elapsed) == -1) {
+				fprintf(stderr, "%s: failed\n", benches[k].name);
+				status = 1;
+				break;
+			}
+
+			if (best == -1 || elapsed < best) {
+				best = elapsed;
+				ops = run_ops;
+			}
+		}
+
+		if (best == -1) continue;
+
+		double ns_per_op = ops ? (double) best / ops : 0.0;
+		double baseline = bench_baseline(benches[k].name);
+		printf("%s\n    {\"name\": \"%s\", \"ops\": %lld, \"seconds\": %.6f, \"ns_per_op\": %.1f",
+			   first ? "" : ",", benches[k].name, ops, best / 1e9, ns_per_op);
+		if (baseline > 0) printf(", \"baseline_ns_per_op\": %.1f, \"ratio\": %.3f", baseline, ns_per_op / baseline);
+		printf("}");
+		fflush(stdout);
+		first = 0;
+	}
+
+	printf("\n  ]\n}\n");
+
+	unlink(bench_generated);
+	rmdir(bench_dir);
+
+	return status;
+}
@@ -3,22 +3,55 @@
 #define _BSD_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <termios.h>
 #include <time.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // Defines
 #define DAVE_ED_VERSION "0.0.1"
 #define DAVE_ED_TAB_STOP 8
+#define DAVE_ED_COLUMN_INDEX_MIN 256
+#define DAVE_ED_RENDER_CHUNK (16 << 10)
+#define DAVE_ED_SYNTAX_DIR ".dave_ed/syntax"
+#define DAVE_ED_SYNTAX_RULES 255
+#define DAVE_ED_SYNTAX_NAME_MAX 20
 #define DAVE_ED_QUIT_WARNINGS 2
+#define DAVE_ED_MMAP_THRESHOLD (1 << 20)
+#define DAVE_ED_RENDER_CACHE_SCREENS 4
+#define DAVE_ED_POOL_SLAB (64 << 10)
+#define DAVE_ED_POOL_MAX 256
+#define DAVE_ED_SEARCH_CHUNK_ROWS 16384
+#define DAVE_ED_SEARCH_THREADS 8
+#define DAVE_ED_SEARCH_BATCH_ROWS 256
+#define DAVE_ED_REGEX_DFA_STATES 1024
+#define DAVE_ED_SAVE_BATCH 1024
+#define DAVE_ED_JOURNAL_COMMIT_MS 1000
+#define DAVE_ED_UNDO_BYTES (16 << 20)
+#define DAVE_ED_FRAME_BUDGET_MS 50
+#define DAVE_ED_LATENCY_SAMPLES 256
+#define DAVE_ED_VIEW_CHECKPOINT_LINES 4096
+#define DAVE_ED_VIEW_READ (1 << 20)
+#define DAVE_ED_VIEW_WINDOW (8 << 20)
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -32,7 +65,8 @@ enum EditorKey {
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	PASTE_START
 };
 
 enum EditorHighlight {
@@ -46,83 +80,363 @@ enum EditorHighlight {
 	HL_MATCH
 };
 
-#define HL_HIGHLIGHT_NUMBERS (1<<0)
-#define HL_HIGHLIGHT_STRINGS (1<<1)
+enum RowCharset {
+	ROW_UNCHECKED = 0,
+	ROW_ASCII,
+	ROW_UTF8
+};
+
+enum EditOp {
+	EDIT_INSERT_ROWS = 1,
+	EDIT_DELETE_ROWS,
+	EDIT_INSERT_TEXT,
+	EDIT_DELETE_TEXT
+};
+
+enum SyntaxRuleKind {
+	RULE_COMMENT = 1,
+	RULE_STRING,
+	RULE_CODE
+};
 
 // Data
+// Keywords are compiled into a collision-free hash table: every keyword
+// gets its own slot, so a lookup is one hash, one probe and one compare.
+struct KeywordTable {
+	unsigned int seed;
+	unsigned int mask;
+	int min_len;
+	int max_len;
+	char **words;
+	unsigned char *lens;
+	unsigned char *classes;
+};
+
+// A rule opens a region of text at its start delimiter, which runs to its
+// end delimiter, or to the end of the line when it has none. Rules nested
+// under it apply within the region, and those under no rule at the top
+// level.
+struct SyntaxRule {
+	int kind;
+	char *start;
+	char *end;
+	int escape;
+	int multiline;
+	int parent;
+	int word;
+};
+
+// The lexer is in one of a few contexts: 0 for the top level and one for
+// the region each rule opens. The delimiters that can come next in each
+// context form a trie, and the tries share one transition table over
+// classes of bytes, so looking for a delimiter takes a lookup per byte.
+// Node 0 is the dead end every missing transition leads to.
+struct SyntaxContext {
+	unsigned char highlight;
+	unsigned char code;
+	unsigned char line_end;
+	int root;
+};
+
+// What reading a delimiter does: moves to context, coloring the delimiter
+// highlight, and for an escape takes the char after it along too. A word
+// delimiter only counts at the start of a line or after a separator.
+struct SyntaxToken {
+	unsigned char context;
+	unsigned char highlight;
+	unsigned char escape;
+	unsigned char word;
+};
+
+// reach is how far past where a delimiter starts reading it can look.
+struct SyntaxLexer {
+	unsigned char classes[256];
+	int num_classes;
+	struct SyntaxContext *contexts;
+	int num_nodes;
+	int *next;
+	int *accept;
+	int num_tokens;
+	struct SyntaxToken *tokens;
+	int reach;
+};
+
 struct EditorSyntax {
 	char *file_type;
 	char **file_match;
 	char **keywords;
-	char *single_line_comment_start;
-	char *multiline_comment_start;
-	char *multiline_comment_end;
-	int flags;
+	int numbers;
+	int num_rules;
+	struct SyntaxRule *rules;
+	struct KeywordTable *keyword_table;
+	struct SyntaxLexer *lexer;
+};
+
+// Long rows and rows that are not plain ASCII keep an index of the chars
+// that do not take one column and one render byte each: tabs, multi-byte
+// and invalid UTF-8. A stop gives where such a char is, its length, and
+// the render column and offset just after it, so chars and columns
+// convert by binary search rather than by a walk from column 0. Edits
+// drop the index.
+struct ColumnStop {
+	int cx;
+	int len;
+	int rx;
+	int ro;
+};
+
+struct ColumnIndex {
+	int num_stops;
+	struct ColumnStop stops[];
+};
+
+// Where a scan of part of a line stopped, so the rest can be scanned on its
+// own. A token running past the end of the part leaves carry chars of the
+// next part to color as carry_highlight.
+struct ScanState {
+	int context;
+	int previous_seperator;
+	int previous_highlight;
+	int carry;
+	int carry_highlight;
+};
+
+#define SCAN_STATE_INIT(context) {(context), 1, HL_NORMAL, 0, HL_NORMAL}
+
+// Rows of DAVE_ED_RENDER_CHUNK chars or more are rendered in chunks of
+// about that size, and only chunks that come into view are built. Each
+// chunk keeps the scan state it starts from, so it can be highlighted on
+// its own. lead and after_tab give its width from any column: the columns
+// before its first tab, and those the chars after that tab take (-1 when
+// it has none). Chunks are dropped when the syntax changes, which moves
+// Ed.syntax_generation on.
+// Chunked rows keep the room left in chars as a gap before char gap, which
+// edits move to where they happen, so typing only moves the chars between
+// one key and the last. Anything that reads the chars whole closes the gap
+// first, moving it to the end, and only the buffer's gap_row has it open.
+struct RenderChunk {
+	int start;
+	int len;
+	int lead;
+	int after_tab;
+	int rx;
+	int layout_stale;
+	int scan_stale;
+	struct ScanState entry;
+	int render_align;
+	int rsize;
+	char *render;
+	unsigned char *highlight;
+};
+
+struct RowChunks {
+	int count;
+	int cap;
+	int rsize;
+	int rx_stale;
+	int exit_state;
+	int cached;
+	int generation;
+	int gap;
+	struct RenderChunk *chunk;
 };
 
+// A row loaded from the file text keeps chars pointing into it, cap 0,
+// until it is first edited. Such chars are not NUL-terminated: they stop
+// at the newline, or at the end of the text, so only size bounds them.
 typedef struct RowStore {
-	int idx;
 	int size;
 	int rsize;
 	char *chars;
 	char *render;
 	unsigned char *highlight;
-	int highlight_open_comment;
+	int highlight_exit_state;
+	int render_stale;
+	int charset;
+	int cap;
+	struct ColumnIndex *columns;
+	struct RowChunks *chunks;
 } rstore;
 
-struct EditorConfig {
+// Rows live in an implicit treap ordered by position, so a row can be
+// inserted or removed anywhere in O(log n) and rstore pointers stay valid.
+typedef struct RowNode {
+	struct RowNode *left;
+	struct RowNode *right;
+	struct RowNode *parent;
+	unsigned int priority;
+	int count;
+	int span;
+	int map_line;
+	int hl_entry;
+	int syntax_stale;
+	int stale_count;
+	rstore row;
+} rnode;
+
+// A node with a non-zero span stands for that many consecutive lines of a
+// memory-mapped file that have not been looked at yet.
+// hl_entry is the lexer state the node was last highlighted from, and
+// syntax_stale marks nodes whose states need redoing; stale_count sums that
+// flag over the subtree so the first stale node can be found in O(log n).
+struct RowCursor {
+	rnode *node;
+	int line;
+};
+
+// One change to the text, followed by the len bytes it inserts or deletes.
+// Deleted rows are kept joined by '\n'.
+struct EditRecord {
+	int op;
+	int row;
+	int at;
+	int len;
+};
+
+struct UndoLog {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+struct UndoHistory {
+	struct UndoLog undo;
+	struct UndoLog redo;
+	int group;
+	int cx;
+	int cy;
+	int suspended;
+};
+
+struct JournalFile {
+	int fd;
+	char *path;
+	int suspended;
+	char *pending;
+	int pending_len;
+	int pending_cap;
+	long long last_commit;
+	struct stat file_stat;
+	int file_known;
+};
+
+// Where the screen looks into a buffer.
+struct EditorView {
 	int cx, cy;
 	int rx;
 	int row_offset;
 	int column_offset;
-	int screen_rows;
-	int screen_cols;
+};
+
+// An open file: its rows, the text they view until edited, whether that
+// was mapped or read in, and the highlighting, undo and journal state
+// that go with them. view is where the screen was when it last showed the
+// buffer.
+struct EditorBuffer {
 	int num_rows;
-	rstore *row;
+	rnode *row_root;
+	char *map;
+	size_t map_size;
+	int mapped;
+	size_t *map_lines;
+	int map_num_lines;
+	unsigned char *map_line_state;
+	int syntax_frontier;
+	rstore *gap_row;
 	int unsaved_changes_flag;
 	char *file_name;
+	struct EditorSyntax *syntax;
+	struct UndoHistory undo;
+	struct JournalFile journal;
+	struct EditorView view;
+};
+
+// Only the buffer on screen keeps renders, so the render cache and screen
+// state belong to the editor rather than to any one buffer.
+struct EditorConfig {
+	struct EditorView view;
+	struct EditorBuffer *buffer;
+	struct EditorBuffer **buffers;
+	int num_buffers;
+	int screen_rows;
+	int screen_cols;
+	int syntax_generation;
+	rstore **render_cache;
+	int render_cache_len;
+	int render_cache_cap;
+	struct ABuf *screen_lines;
+	int screen_lines_len;
+	int screen_valid;
+	int screen_row_offset;
+	int frame_allocations;
+	int show_stats;
+	int headless;
+	char *program;
 	char status_message[80];
 	time_t status_message_time;
-	struct EditorSyntax *syntax;
 	struct termios orig_termios;
 };
 
 struct EditorConfig Ed;
 
+// Held for writing whenever the row tree changes shape, since search
+// workers may be reading it at the same time. Writers go first, so a key
+// never waits behind a stream of workers, and workers only read for a
+// batch of rows at a time.
+pthread_rwlock_t rows_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
 // FileTypes
-char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
-char *C_HL_keywords[] = {
-	"switch", "if", "while", "for", "break", "continue", "return", "else", "struct", "union", "typedef", "static", "enum", "class", "case", "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|", "void|", NULL
-};
+// Syntax definitions are read from the *.syntax files in ~/DAVE_ED_SYNTAX_DIR,
+// in the syntax directory next to the binary and in any directory the
+// build names, in that order, and the first definition of a name wins. C is built in, for when there are none.
+char C_HL_definition[] =
+	"name c\n"
+	"match .c .h .cpp\n"
+	"numbers\n"
+	"keywords switch if while for break continue return else struct union typedef static enum class case\n"
+	"types int long double float char unsigned signed void\n"
+	"comment //\n"
+	"comment /* */ multiline\n"
+	"string \" \" escape \\\n"
+	"string ' ' escape \\\n";
 
 // Highlight Database
-struct EditorSyntax HLDB[] = {
-	{
-		"c",
-		C_HL_extensions,
-		C_HL_keywords,
-		"//", "/*", "*/",
-		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
-	},
-};
-
-#define HLDB_ENTRIES  (sizeof(HLDB) / sizeof(HLDB[0]))
+struct EditorSyntax **HLDB;
+int hldb_len;
 
 // Prototypes
 void editor_set_status_message(const char *fmt, ...);
 void editor_refresh_screen();
 char *editor_prompt(char *prompt, void (*callback)(char *, int));
+int editor_find_poll();
+void editor_wait_event();
+int editor_journal_timeout();
+void editor_screen_resize();
+void editor_journal_record(int op, int row, int at, const char *s, int len);
+void editor_undo_record(int op, int row, int at, const char *s, int len);
+void editor_journal_poll();
+int editor_view_poll();
+void init_editor();
+void editor_render_cache_add(rstore *row);
+void editor_render_cache_remove(rstore *row);
+void editor_row_evict(rstore *row);
+void editor_free_row(rstore *row);
+int editor_row_chunked(rstore *row);
+int editor_chunks_settle(rstore *row, int context);
 
 // Terminal
 void die(const char *s) {
-	write(STDOUT_FILENO, "\x1b[2J", 4);
-  	write(STDOUT_FILENO, "\x1b[H", 3);
+	if (!Ed.headless) {
+		write(STDOUT_FILENO, "\x1b[2J", 4);
+		write(STDOUT_FILENO, "\x1b[H", 3);
+	}
 
 	perror(s);
 	exit(1);
 }
 
 void disable_raw_mode() {
+	write(STDOUT_FILENO, "\x1b[?2004l", 8);
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &Ed.orig_termios) == -1) die("tcsetattr");
 }
 
@@ -136,59 +450,172 @@ void enable_raw_mode() {
 	raw.c_cflag &= ~(CS8);
 	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
+	raw.c_cc[VTIME] = 0;
 
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+	// Bracketed paste: the terminal wraps pasted text in ESC[200~ and
+	// ESC[201~ so it can be inserted in one piece instead of key by key.
+	write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editor_read_key() {
-	int nread;
-	char c;
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if (nread == -1 && errno != EAGAIN) die("read");
-	}
-
-	if (c == '\x1b') {
-		char sequence[3];
-
-		if (read(STDIN_FILENO, &sequence[0], 1) != 1) return '\x1b';
-		if (read(STDIN_FILENO, &sequence[1], 1) != 1) return '\x1b';
-
-		if (sequence[0] == '[') {
-			if (sequence[1] >= '0' && sequence[1] <= '9') {
-				if (read(STDIN_FILENO, &sequence[2], 1) != 1) return '\x1b';
-				if (sequence[2] == '*') {
-					switch (sequence[1]) {
-						case '1': return HOME_KEY;
-						case '3': return DELETE_KEY;
-						case '4': return END_KEY;
-						case '5': return PAGE_UP;
-						case '6': return PAGE_DOWN;
-						case '7': return HOME_KEY;
-						case '8': return END_KEY;
-					}
-				}
-			} else {
-				switch (sequence[1]) {
-					case 'A': return ARROW_UP;
-					case 'B': return ARROW_DOWN;
-					case 'C': return ARROW_RIGHT;
-					case 'D': return ARROW_LEFT;
-					case 'H': return HOME_KEY;
-					case 'F': return END_KEY;
-				}
+// Input is read in as large pieces as the terminal has ready and decoded
+// from a buffer, so a burst of keys costs one read rather than one per byte.
+struct {
+	char buffer[4096];
+	int start;
+	int len;
+} Input;
+
+// Returns the number of bytes read, or 0 when none are ready.
+int editor_input_read() {
+	if (Input.start > 0) {
+		memmove(Input.buffer, Input.buffer + Input.start, Input.len - Input.start);
+		Input.len -= Input.start;
+		Input.start = 0;
+	}
+
+	if (Input.len == sizeof(Input.buffer)) return 0;
+
+	int nread = read(STDIN_FILENO, Input.buffer + Input.len, sizeof(Input.buffer) - Input.len);
+	if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+	if (nread <= 0) return 0;
+
+	Input.len += nread;
+
+	return nread;
+}
+
+// Waits up to timeout milliseconds for more input to read.
+int editor_input_wait(int timeout) {
+	struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+
+	return poll(&pfd, 1, timeout) > 0;
+}
+
+// Whether a key is waiting, either buffered or still unread.
+int editor_input_pending() {
+	return Input.start < Input.len || editor_input_wait(0);
+}
+
+// Decodes the key at the front of s and sets *used to its length. Returns
+// -1 when s ends partway through an escape sequence.
+int editor_decode_key(const char *s, int len, int *used) {
+	*used = 1;
+	if (s[0] != '\x1b') return (unsigned char) s[0];
+	if (len < 2) return -1;
+
+	if (s[1] == '[') {
+		int i = 2;
+		while (i < len && s[i] >= 0x20 && s[i] <= 0x3f) i++;
+		if (i == len) return -1;
+
+		*used = i + 1;
+		if (s[i] == '~') {
+			switch (atoi(s + 2)) {
+				case 1: return HOME_KEY;
+				case 3: return DELETE_KEY;
+				case 4: return END_KEY;
+				case 5: return PAGE_UP;
+				case 6: return PAGE_DOWN;
+				case 7: return HOME_KEY;
+				case 8: return END_KEY;
+				case 200: return PASTE_START;
 			}
-		} else if (sequence[0] == 'O') {
-			switch (sequence[1]) {
+		} else {
+			switch (s[i]) {
+				case 'A': return ARROW_UP;
+				case 'B': return ARROW_DOWN;
+				case 'C': return ARROW_RIGHT;
+				case 'D': return ARROW_LEFT;
 				case 'H': return HOME_KEY;
 				case 'F': return END_KEY;
 			}
 		}
+	} else if (s[1] == 'O') {
+		if (len < 3) return -1;
 
-		return '\x1b';
-	} else {
-		return c;
+		*used = 3;
+		switch (s[2]) {
+			case 'H': return HOME_KEY;
+			case 'F': return END_KEY;
+		}
+	}
+
+	return '\x1b';
+}
+
+int editor_read_key() {
+	while (Input.start == Input.len) {
+		if (editor_input_read()) break;
+
+		editor_wait_event();
+	}
+
+	int key, used;
+	while ((key = editor_decode_key(Input.buffer + Input.start, Input.len - Input.start, &used)) == -1) {
+		// The rest of the sequence may still be on its way; if it does not
+		// come, this was a lone escape.
+		if (!editor_input_wait(100) || editor_input_read() == 0) {
+			key = '\x1b';
+			used = 1;
+			break;
+		}
+	}
+
+	Input.start += used;
+
+	return key;
+}
+
+// Collects pasted text up to the closing ESC[201~, turning the carriage
+// returns terminals send for line breaks into '\n'.
+char *editor_read_paste(size_t *len) {
+	size_t cap = 4096;
+	char *text = malloc(cap);
+	int after_cr = 0;
+	*len = 0;
+
+	while (1) {
+		char *s = Input.buffer + Input.start;
+		int available = Input.len - Input.start;
+		char *end = memmem(s, available, "\x1b[201~", 6);
+
+		// The last few bytes may be the start of a marker split across reads.
+		int take = end ? end - s : (available > 5 ? available - 5 : 0);
+		if (*len + take > cap) {
+			while (*len + take > cap) cap *= 2;
+			text = realloc(text, cap);
+		}
+
+		for (int k = 0; k < take; k++) {
+			if (s[k] == '\n' && after_cr) {
+				after_cr = 0;
+				continue;
+			}
+
+			after_cr = s[k] == '\r';
+			text[(*len)++] = after_cr ? '\n' : s[k];
+		}
+
+		Input.start += take;
+		if (end) {
+			Input.start += 6;
+			break;
+		}
+
+		// A terminal that never closes the paste gets what it sent.
+		if (!editor_input_wait(1000) || editor_input_read() == 0) {
+			available = Input.len - Input.start;
+			text = realloc(text, *len + available + 1);
+			memcpy(text + *len, Input.buffer + Input.start, available);
+			*len += available;
+			Input.start = Input.len;
+			break;
+		}
 	}
+
+	return text;
 }
 
 int get_cursor_position(int *rows, int *cols) {
@@ -200,7 +627,7 @@ int get_cursor_position(int *rows, int *cols) {
 	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
 	while (i < sizeof(buffer) - 1) {
-		if (read(STDIN_FILENO, &buffer[i], 1) != 1) break;
+		if (!editor_input_wait(1000) || read(STDIN_FILENO, &buffer[i], 1) != 1) break;
 		if (buffer[i] == 'R') break;
 		i++;
 	}
@@ -226,537 +653,5087 @@ int get_window_size(int *rows, int *cols) {
 	}
 }
 
-// Syntax Highlighting
-int is_seperator(int c) {
-	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+// Events
+// Between keys the editor sleeps in poll until input arrives, the window
+// is resized, search workers report progress or a timer falls due, so an
+// idle editor costs no CPU at all. Signal handlers and worker threads
+// reach the loop by writing a byte to a self-pipe.
+int wake_pipe[2] = {-1, -1};
+
+void editor_wake(char reason) {
+	int saved_errno = errno;
+	write(wake_pipe[1], &reason, 1);
+	errno = saved_errno;
 }
 
-void editor_update_syntax(rstore *row) {
-	row -> highlight = realloc(row -> highlight, row -> rsize);
-	memset(row -> highlight, HL_NORMAL, row -> rsize);
-
-	if (Ed.syntax == NULL) return;
-
-	char **keywords = Ed.syntax -> keywords;
-	char *scs = Ed.syntax -> single_line_comment_start;
-	char *mcs = Ed.syntax -> multiline_comment_start;
-	char *mce = Ed.syntax -> multiline_comment_end;
+void editor_handle_sigwinch(int sig) {
+	(void) sig;
+	editor_wake('w');
+}
 
-	int scs_len = scs ? strlen(scs) : 0;
-	int mcs_len = mcs ? strlen(mcs) : 0;
-	int mce_len = mce ? strlen(mce) : 0;
+void editor_init_events() {
+	if (pipe(wake_pipe) == -1) die("pipe");
+	for (int k = 0; k < 2; k++) {
+		fcntl(wake_pipe[k], F_SETFL, O_NONBLOCK);
+		fcntl(wake_pipe[k], F_SETFD, FD_CLOEXEC);
+	}
 
-	int previous_seperator = 1;
-	int in_string = 0;
-	int in_comment = (row -> idx > 0 && Ed.row[row -> idx - 1].highlight_open_comment);
-	int i = 0;
-	while (i < row -> rsize) {
-		char c = row -> render[i];
-		unsigned char previous_highlight = (i > 0) ? row -> highlight[i - 1] : HL_NORMAL;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = editor_handle_sigwinch;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
 
-		if (scs_len && !in_string && !in_comment) {
-			if (!strncmp(&row -> render[i], scs, scs_len)) {
-				memset(&row -> highlight[i], HL_COMMENT, row -> rsize - i);
+void editor_handle_resize() {
+	int rows, cols;
+	if (get_window_size(&rows, &cols) == -1) return;
 
-				break;
-			}
-		}
+	Ed.screen_rows = rows - 2;
+	Ed.screen_cols = cols;
+	editor_screen_resize();
+}
 
-		if (mcs_len && mcs_len && !in_string) {
-			if (in_comment) {
-				row -> highlight[i] = HL_MLCOMMENT;
-				if (!strncmp(&row -> render[i], mce, mce_len)) {
-					memset(&row -> highlight[i], HL_MLCOMMENT, mce_len);
-					i += mce_len;
-					in_comment = 0;
-					previous_seperator = 1;
+// Milliseconds until the status message is due to vanish, or -1.
+int editor_status_timeout() {
+	if (Ed.status_message[0] == '\0') return -1;
 
-					continue;
-				} else {
-					i++;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long long left = (Ed.status_message_time + 5) * 1000LL - (now.tv_sec * 1000LL + now.tv_nsec / 1000000);
 
-					continue;
-				}
-			} else if (!strncmp(&row -> render[i], mcs, mcs_len)) {
-				memset(&row -> highlight[i], HL_MLCOMMENT, mcs_len);
-				i += mcs_len;
-				in_comment = 1;
+	return left >= 0 ? left + 1 : -1;
+}
 
-				continue;
+// Sleeps until there is input to read, dealing with whatever else wakes
+// it first and redrawing when that changed the screen.
+void editor_wait_event() {
+	int timeout = editor_status_timeout();
+	int journal_timeout = editor_journal_timeout();
+	if (journal_timeout != -1 && (timeout == -1 || journal_timeout < timeout)) timeout = journal_timeout;
+
+	struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {wake_pipe[0], POLLIN, 0}};
+	int ready = poll(fds, 2, timeout);
+	if (ready == -1 && errno != EINTR) die("poll");
+
+	int redraw = ready == 0;
+	if (ready > 0 && (fds[1].revents & POLLIN)) {
+		char reasons[64];
+		ssize_t n;
+		int resized = 0, indexed = 0;
+		while ((n = read(wake_pipe[0], reasons, sizeof(reasons))) > 0) {
+			for (int k = 0; k < n; k++) {
+				if (reasons[k] == 'w') resized = 1;
+				if (reasons[k] == 'v') indexed = 1;
 			}
 		}
 
-		if (Ed.syntax -> flags & HL_HIGHLIGHT_STRINGS) {
-			if (in_string) {
-				row -> highlight[i] = HL_STRING;
-				if (c == '\\' && i + 1 < row -> rsize) {
-					row -> highlight[i + 1] = HL_STRING;
-					i += 2;
-
-					continue;
-				}
-
-				if (c == in_string) in_string = 0;
-				i++;
-				previous_seperator = 1;
-
-				continue;
-			} else {
-				if (c == '"' || c == '\'') {
-					in_string = c;
-					row -> highlight[i] = HL_STRING;
-					i++;
+		if (resized) editor_handle_resize();
+		redraw = editor_find_poll() || resized;
+		if (indexed && editor_view_poll()) redraw = 1;
+	}
 
-					continue;
-				}
-			}
-		}
+	editor_journal_poll();
+	if (redraw) editor_refresh_screen();
+}
 
-		if (Ed.syntax -> flags & HL_HIGHLIGHT_NUMBERS) {
-			if ((isdigit(c) && (previous_seperator || previous_highlight == HL_NUMBER)) || (c == '.' && previous_highlight == HL_NUMBER)) {
-				row -> highlight[i] = HL_NUMBER;
-				i++;
-				previous_seperator = 0;
-				continue;
-			}
-		}
+// Stats
+// Timing probes behind the Ctrl-T overlay and the --trace file. A probe
+// only reads the clock while one of those is on. Latency runs from the
+// first key of a batch being read to its frame being written.
+enum StatsPhase {
+	STATS_INPUT = 0,
+	STATS_SYNTAX,
+	STATS_DRAW,
+	STATS_WRITE,
+	STATS_PHASES
+};
 
-		if (previous_seperator) {
-			int j = 0;
-			for (j = 0; keywords[j]; j++) {
-				int klen = strlen(keywords[j]);
-				int keyword_two = keywords[j][klen - 1] == '|';
-				if (keyword_two) klen--;
+struct {
+	FILE *trace;
+	int trace_events;
+	long long key_time;
+	long long phase_us[STATS_PHASES];
+	long long frame_us[STATS_PHASES];
+	int frame_bytes;
+	int latency_us[DAVE_ED_LATENCY_SAMPLES];
+	int num_latencies;
+} Stats;
+
+long long editor_now_us() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
 
-				if (!strncmp(&row -> render[i], keywords[j], klen) && is_seperator(row -> render[i + klen])) {
-					memset(&row -> highlight[i], keyword_two ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-					i += klen;
+long long editor_probe_start() {
+	return Ed.show_stats || Stats.trace ? editor_now_us() : 0;
+}
 
-					break;
-				}
-			}
+// Adds the time since start to the phase and traces it as a complete event.
+void editor_probe_end(const char *name, long long start, int phase) {
+	if (start == 0) return;
 
-			if (keywords[j] != NULL) {
-				previous_seperator = 0;
+	long long now = editor_now_us();
+	Stats.phase_us[phase] += now - start;
+	if (Stats.trace)
+		fprintf(Stats.trace, "%s{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %lld, \"dur\": %lld, \"pid\": 1, \"tid\": 1}",
+				Stats.trace_events++ ? ",\n" : "", name, start, now - start);
+}
 
-				continue;
-			}
-		}
+// Closes the books on a frame of bytes bytes that has just been written.
+void editor_stats_frame(int bytes) {
+	memcpy(Stats.frame_us, Stats.phase_us, sizeof(Stats.phase_us));
+	memset(Stats.phase_us, 0, sizeof(Stats.phase_us));
 
-		previous_seperator = is_seperator(c);
-		i++;
+	Stats.frame_bytes = bytes;
+	if (Stats.key_time) {
+		Stats.latency_us[Stats.num_latencies++ % DAVE_ED_LATENCY_SAMPLES] = editor_now_us() - Stats.key_time;
+		Stats.key_time = 0;
 	}
+}
 
-	int changed = (row -> highlight_open_comment != in_comment);
-	row -> highlight_open_comment = in_comment;
+int editor_compare_int(const void *a, const void *b) {
+	return *(const int *) a - *(const int *) b;
+}
 
-	if (changed && row -> idx + 1 < Ed.num_rows)
-		editor_update_syntax(&Ed.row[row -> idx + 1]);
+// Sets *p50 and *p99 from the latest samples, in milliseconds.
+void editor_stats_latency(double *p50, double *p99) {
+	int count = Stats.num_latencies < DAVE_ED_LATENCY_SAMPLES ? Stats.num_latencies : DAVE_ED_LATENCY_SAMPLES;
+	*p50 = *p99 = 0;
+	if (count == 0) return;
+
+	int sorted[DAVE_ED_LATENCY_SAMPLES];
+	memcpy(sorted, Stats.latency_us, sizeof(int) * count);
+	qsort(sorted, count, sizeof(int), editor_compare_int);
+	*p50 = sorted[count / 2] / 1000.0;
+	*p99 = sorted[count * 99 / 100] / 1000.0;
 }
 
-int editor_syntax_to_color(int highlight) {
-	switch (highlight) {
-		case HL_COMMENT: 
-		case HL_MLCOMMENT: return 36;
-		case HL_KEYWORD1: return 34;
-		case HL_KEYWORD2: return 32;
-		case HL_STRING: return 35;
-		case HL_NUMBER: return 31;
-		case HL_MATCH: return 34;
-		default: return 37;
-	}
+void editor_trace_close() {
+	fprintf(Stats.trace, "\n]\n");
+	fclose(Stats.trace);
+	Stats.trace = NULL;
 }
 
-void editor_select_syntax_highlight() {
-	Ed.syntax = NULL;
-	if (Ed.file_name == NULL) return;
+// Events go out in Chrome's trace event format, for chrome://tracing or
+// Perfetto to load.
+void editor_trace_open(char *path) {
+	Stats.trace = fopen(path, "w");
+	if (!Stats.trace) die("fopen");
 
-	char *ext = strrchr(Ed.file_name, '.');
+	fprintf(Stats.trace, "[\n");
+	atexit(editor_trace_close);
+}
 
-	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-		struct EditorSyntax *s = &HLDB[j];
-		unsigned int i = 0;
+// Pool
+// Row nodes and the chars of edited rows come from slabs shared by every
+// buffer. Blocks are handed out in 16 byte size classes, and a freed block
+// goes on its class's free list for any buffer to reuse, so a row costs
+// its size rounded up rather than its size plus malloc's header. Blocks
+// over DAVE_ED_POOL_MAX bytes come from malloc.
+#define POOL_GRAIN 16
+#define POOL_CLASSES (DAVE_ED_POOL_MAX / POOL_GRAIN + 1)
+
+struct PoolBlock {
+	struct PoolBlock *next;
+};
 
-		while (s -> file_match[i]) {
-			int is_ext = (s -> file_match[i][0] == '.');
-			if ((is_ext && ext && !strcmp(ext, s -> file_match[i])) || (!is_ext && strstr(Ed.file_name, s -> file_match[i]))) {
-				Ed.syntax = s;
+struct {
+	struct PoolBlock *free[POOL_CLASSES];
+	char *slab;
+	size_t slab_left;
+} Pool;
 
-				int file_row;
-				for (file_row = 0; file_row < Ed.num_rows; file_row++) {
-					editor_update_syntax(&Ed.row[file_row]);
-				}
+int pool_class(size_t size) {
+	return (size + POOL_GRAIN - 1) / POOL_GRAIN;
+}
 
-				return;
-			}
+void *pool_alloc(size_t size) {
+	if (size > DAVE_ED_POOL_MAX) {
+		void *block = malloc(size);
+		if (block == NULL) die("malloc");
 
-			i++;
-		}
+		return block;
 	}
-}
 
-// Row Operations
-int editor_row_cx_to_rx(rstore *row, int cx) {
-	int rx = 0;
-	int j = -1;
-	for (j = 0; j < cx; j++) {
-		if (row -> chars[j] == '\t')
-			rx += (DAVE_ED_TAB_STOP - 1) - (rx % DAVE_ED_TAB_STOP);
-		rx++;
+	int class = pool_class(size ? size : 1);
+	struct PoolBlock *block = Pool.free[class];
+	if (block) {
+		Pool.free[class] = block -> next;
+
+		return block;
 	}
 
-	return rx;
+	// What is left of a slab too small for the block is given up on.
+	size_t bytes = class * POOL_GRAIN;
+	if (Pool.slab_left < bytes) {
+		Pool.slab = malloc(DAVE_ED_POOL_SLAB);
+		if (Pool.slab == NULL) die("malloc");
+
+		Pool.slab_left = DAVE_ED_POOL_SLAB;
+	}
+
+	void *carved = Pool.slab;
+	Pool.slab += bytes;
+	Pool.slab_left -= bytes;
+
+	return carved;
 }
 
-int editor_row_rx_to_cx(rstore *row, int rx) {
-	int cur_rx = 0;
-	int cx = 0;
-	for (cx = 0; cx < row -> size; cx++) {
-		if (row -> chars[cx] == '\t')
-			cur_rx += (DAVE_ED_TAB_STOP - 1) - (cur_rx % DAVE_ED_TAB_STOP);
-		cur_rx++;
+// size must be what the block was allocated with.
+void pool_free(void *p, size_t size) {
+	if (p == NULL) return;
 
-		if (cur_rx > rx) return cx;
+	if (size > DAVE_ED_POOL_MAX) {
+		free(p);
+
+		return;
 	}
 
-	return cx;
+	struct PoolBlock *block = p;
+	int class = pool_class(size ? size : 1);
+	block -> next = Pool.free[class];
+	Pool.free[class] = block;
 }
 
-void editor_update_row(rstore *row) {
-	int tabs = 0;
-	int j = -1;
-	for (j = 0; j < row -> size; j++)
-		if (row -> chars[j] == '\t') tabs++;
+void *pool_realloc(void *p, size_t old_size, size_t size) {
+	if (p == NULL) return pool_alloc(size);
 
-	free(row -> render);
-	row -> render = malloc(row -> size + tabs * (DAVE_ED_TAB_STOP - 1) + 1);
+	if (old_size > DAVE_ED_POOL_MAX && size > DAVE_ED_POOL_MAX) {
+		p = realloc(p, size);
+		if (p == NULL) die("realloc");
 
-	int idx = 0;
-	for (j = 0; j < row -> size; j++) {
-		if (row -> chars[j] == '\t') {
-			row -> render[idx++] = ' ';
-			while (idx % DAVE_ED_TAB_STOP != 0) row -> render[idx++] = ' ';
-		} else {
-			row -> render[idx++] = row -> chars[j];
-		}
+		return p;
 	}
 
-	row -> render[idx] = '\0';
-	row -> rsize = idx;
+	if (old_size <= DAVE_ED_POOL_MAX && size <= DAVE_ED_POOL_MAX && pool_class(old_size ? old_size : 1) == pool_class(size ? size : 1))
+		return p;
 
-	editor_update_syntax(row);
+	void *block = pool_alloc(size);
+	memcpy(block, p, old_size < size ? old_size : size);
+	pool_free(p, old_size);
+
+	return block;
 }
 
-void editor_insert_row(int at, char *s, size_t len) {
-	if (at < 0 || at > Ed.num_rows) return;
+// Row Store
+#define ROW_NODE(r) ((rnode *) ((char *) (r) - offsetof(rnode, row)))
 
-	Ed.row = realloc(Ed.row, sizeof(rstore) * (Ed.num_rows + 1));
-	memmove(&Ed.row[at + 1], &Ed.row[at], sizeof(rstore) * (Ed.num_rows - at));
-	for (int j = at + 1; j <= Ed.num_rows; j++) Ed.row[j].idx++;
+unsigned int editor_row_priority() {
+	static unsigned int seed = 2463534242u;
 
-	Ed.row[at].idx = at;
-	Ed.row[at].size = len;
-	Ed.row[at].chars = malloc(len + 1);
-	memcpy(Ed.row[at].chars, s, len);
-	Ed.row[at].chars[len] = '\0';
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
 
-	Ed.row[at].rsize = 0;
-	Ed.row[at].render = NULL;
-	Ed.row[at].highlight = NULL;
-	Ed.row[at].highlight_open_comment = 0;
-	editor_update_row(&Ed.row[at]);
+	return seed;
+}
 
-	Ed.num_rows++;
-	Ed.unsaved_changes_flag++;
+int row_node_count(rnode *node) {
+	return node ? node -> count : 0;
 }
 
-void editor_free_row(rstore *row) {
-	free(row -> render);
-	free(row -> chars);
-	free(row -> highlight);
+int row_node_weight(rnode *node) {
+	return node -> span ? node -> span : 1;
 }
 
-void editor_delete_row(int at) {
-	if (at < 0 || at >= Ed.num_rows) return;
-	editor_free_row(&Ed.row[at]);
-	memmove(&Ed.row[at], &Ed.row[at + 1], sizeof(rstore) * (Ed.num_rows - at - 1));
-	for (int j = at; j < Ed.num_rows - 1; j++) Ed.row[j].idx--;
-	Ed.num_rows--;
-	Ed.unsaved_changes_flag++;
+int row_node_stale_count(rnode *node) {
+	return node ? node -> stale_count : 0;
 }
 
-void editor_row_insert_character(rstore *row, int at, int c) {
-	if (at < 0 || at > row -> size) at = row -> size;
-	row -> chars = realloc(row -> chars, row -> size + 2);
-	memmove(&row -> chars[at + 1], &row -> chars[at], row -> size - at + 1);
-	row -> size++;
-	row -> chars[at] = c;
-	editor_update_row(row);
-	Ed.unsaved_changes_flag++;
+void row_node_update(rnode *node) {
+	node -> count = row_node_count(node -> left) + row_node_weight(node) + row_node_count(node -> right);
+	node -> stale_count = row_node_stale_count(node -> left) + node -> syntax_stale + row_node_stale_count(node -> right);
+	if (node -> left) node -> left -> parent = node;
+	if (node -> right) node -> right -> parent = node;
 }
 
-void editor_row_append_string(rstore *row, char *s, size_t len) {
-	row -> chars = realloc(row -> chars, row -> size + len + 1);
-	memcpy(&row -> chars[row -> size], s, len);
-	row -> size += len;
-	row -> chars[row -> size] = '\0';
-	editor_update_row(row);
-	Ed.unsaved_changes_flag++;
+rnode *row_node_new(int span, int map_line) {
+	rnode *node = pool_alloc(sizeof(rnode));
+	memset(node, 0, sizeof(rnode));
+
+	node -> priority = editor_row_priority();
+	node -> span = span;
+	node -> map_line = map_line;
+	node -> hl_entry = -1;
+	node -> syntax_stale = 1;
+	row_node_update(node);
+
+	return node;
 }
 
-void editor_row_delete_character(rstore *row, int at) {
-	if (at < 0 || at >= row -> size) return;
-	memmove(&row -> chars[at], &row -> chars[at + 1], row -> size - at);
-	row -> size--;
-	editor_update_row(row);
-	Ed.unsaved_changes_flag++;
+void row_node_set_stale(rnode *node, int stale) {
+	if (node -> syntax_stale == stale) return;
+
+	node -> syntax_stale = stale;
+	for (; node; node = node -> parent) node -> stale_count += stale ? 1 : -1;
 }
 
-// Editor Operations
-void editor_insert_character(int c) {
-	if (Ed.cy == Ed.num_rows) {
-		editor_insert_row(Ed.num_rows, "", 0);
-	}
+void row_node_mark_all_stale(rnode *node) {
+	if (node == NULL) return;
 
-	editor_row_insert_character(&Ed.row[Ed.cy], Ed.cx, c);
-	Ed.cx++;
+	row_node_mark_all_stale(node -> left);
+	row_node_mark_all_stale(node -> right);
+	node -> syntax_stale = 1;
+	row_node_update(node);
 }
 
-void editor_insert_new_line() {
-	if (Ed.cx == 0) {
-		editor_insert_row(Ed.cy, "", 0);
-	} else {
-		rstore *row = &Ed.row[Ed.cy];
-		editor_insert_row(Ed.cy + 1, &row -> chars[Ed.cx], row -> size - Ed.cx);
-		row = &Ed.row[Ed.cy];
-		row -> size = Ed.cx;
+rnode *row_node_first_stale() {
+	rnode *node = Ed.buffer -> row_root;
+	while (node && node -> stale_count) {
+		if (row_node_stale_count(node -> left)) {
+			node = node -> left;
+		} else if (node -> syntax_stale) {
+			return node;
+		} else {
+			node = node -> right;
+		}
+	}
+
+	return NULL;
+}
+
+int row_node_position(rnode *node) {
+	int at = row_node_count(node -> left);
+
+	while (node -> parent) {
+		if (node == node -> parent -> right)
+			at += row_node_count(node -> parent -> left) + row_node_weight(node -> parent);
+		node = node -> parent;
+	}
+
+	return at;
+}
+
+rnode *row_node_merge(rnode *a, rnode *b) {
+	if (a == NULL) return b;
+	if (b == NULL) return a;
+
+	if (a -> priority > b -> priority) {
+		a -> right = row_node_merge(a -> right, b);
+		row_node_update(a);
+
+		return a;
+	} else {
+		b -> left = row_node_merge(a, b -> left);
+		row_node_update(b);
+
+		return b;
+	}
+}
+
+// Splits off the first k rows of the tree into *l and the remainder into *r.
+// k must fall on a node boundary, never inside a mapped span.
+void row_node_split(rnode *node, int k, rnode **l, rnode **r) {
+	if (node == NULL) {
+		*l = *r = NULL;
+
+		return;
+	}
+
+	int left_count = row_node_count(node -> left);
+	if (k <= left_count) {
+		row_node_split(node -> left, k, l, &node -> left);
+		row_node_update(node);
+		*r = node;
+	} else {
+		row_node_split(node -> right, k - left_count - row_node_weight(node), &node -> right, r);
+		row_node_update(node);
+		*l = node;
+	}
+}
+
+rnode *row_node_next(rnode *node) {
+	if (node -> right) {
+		node = node -> right;
+		while (node -> left) node = node -> left;
+
+		return node;
+	}
+
+	while (node -> parent && node == node -> parent -> right) node = node -> parent;
+
+	return node -> parent;
+}
+
+rnode *row_node_prev(rnode *node) {
+	if (node -> left) {
+		node = node -> left;
+		while (node -> right) node = node -> right;
+
+		return node;
+	}
+
+	while (node -> parent && node == node -> parent -> left) node = node -> parent;
+
+	return node -> parent;
+}
+
+// Finds the node holding row at, and how far into a mapped span it lies.
+rnode *row_node_find(int at, int *offset) {
+	rnode *node = Ed.buffer -> row_root;
+	while (node) {
+		int left_count = row_node_count(node -> left);
+		if (at < left_count) {
+			node = node -> left;
+		} else if (at < left_count + row_node_weight(node)) {
+			*offset = at - left_count;
+
+			return node;
+		} else {
+			at -= left_count + row_node_weight(node);
+			node = node -> right;
+		}
+	}
+
+	return NULL;
+}
+
+void editor_map_line(int line, char **s, int *len) {
+	size_t start = Ed.buffer -> map_lines[line];
+	size_t end = (line + 1 < Ed.buffer -> map_num_lines) ? Ed.buffer -> map_lines[line + 1] : Ed.buffer -> map_size;
+
+	if (end > start && Ed.buffer -> map[end - 1] == '\n') end--;
+	if (end > start && Ed.buffer -> map[end - 1] == '\r') end--;
+
+	*s = Ed.buffer -> map + start;
+	*len = end - start;
+}
+
+int editor_row_is_mapped(rstore *row) {
+	return Ed.buffer -> map && row -> chars >= Ed.buffer -> map && row -> chars < Ed.buffer -> map + Ed.buffer -> map_size;
+}
+
+// Cuts the mapped span node starting at row start in two after offset
+// lines, keeping the lexer states already worked out for its lines.
+rnode *editor_span_cut(rnode *node, int start, int offset) {
+	rnode *l, *m, *r;
+	row_node_split(Ed.buffer -> row_root, start, &l, &m);
+	row_node_split(m, node -> span, &m, &r);
+
+	rnode *tail = row_node_new(node -> span - offset, node -> map_line + offset);
+	tail -> hl_entry = (node -> hl_entry < 0) ? -1 : Ed.buffer -> map_line_state[tail -> map_line - 1];
+	tail -> syntax_stale = node -> syntax_stale;
+	row_node_update(tail);
+
+	node -> span = offset;
+	node -> left = node -> right = NULL;
+	row_node_update(node);
+
+	Ed.buffer -> row_root = row_node_merge(row_node_merge(l, node), row_node_merge(tail, r));
+	Ed.buffer -> row_root -> parent = NULL;
+
+	return tail;
+}
+
+// Carves line offset out of the mapped span node starting at row start,
+// turning it into a row that views the mapping without copying.
+rstore *editor_row_load(rnode *node, int start, int offset) {
+	if (offset > 0) node = editor_span_cut(node, start, offset);
+	if (node -> span > 1) editor_span_cut(node, start + offset, 1);
+
+	int line = node -> map_line;
+	node -> span = 0;
+	node -> map_line = 0;
+
+	rstore *row = &node -> row;
+	editor_map_line(line, &row -> chars, &row -> size);
+	row -> highlight_exit_state = Ed.buffer -> map_line_state[line];
+	row -> render_stale = 1;
+
+	return row;
+}
+
+// The line of the mapped text a row still views whole, or -1 once it has
+// been edited.
+int editor_row_map_line(rstore *row) {
+	if (!editor_row_is_mapped(row)) return -1;
+
+	size_t start = row -> chars - Ed.buffer -> map;
+	int low = 0, high = Ed.buffer -> map_num_lines - 1;
+	while (low < high) {
+		int mid = (low + high + 1) / 2;
+		if (Ed.buffer -> map_lines[mid] <= start) {
+			low = mid;
+		} else {
+			high = mid - 1;
+		}
+	}
+
+	char *s;
+	int len;
+	editor_map_line(low, &s, &len);
+
+	return s == row -> chars && len == row -> size ? low : -1;
+}
+
+// Folds runs of rows that only view the mapped text back into spans, with
+// the lexer states they got to, so a buffer that has been looked through
+// shrinks back to its line index. The tree is built again from the nodes
+// left.
+void editor_rows_fold() {
+	if (Ed.buffer -> map == NULL || Ed.buffer -> row_root == NULL) return;
+
+	int len = 0, cap = 64;
+	rnode **nodes = malloc(sizeof(rnode *) * cap);
+	if (nodes == NULL) die("malloc");
+
+	rnode *node = Ed.buffer -> row_root;
+	while (node -> left) node = node -> left;
+
+	rnode *span = NULL;
+	while (node) {
+		rnode *next = row_node_next(node);
+		int line = node -> span ? node -> map_line : editor_row_map_line(&node -> row);
+
+		if (line >= 0 && node -> span == 0) {
+			Ed.buffer -> map_line_state[line] = node -> row.highlight_exit_state;
+			editor_free_row(&node -> row);
+			memset(&node -> row, 0, sizeof(rstore));
+			node -> span = 1;
+			node -> map_line = line;
+		}
+
+		if (line >= 0 && span && span -> map_line + span -> span == line) {
+			span -> span += node -> span;
+			span -> syntax_stale |= node -> syntax_stale;
+			pool_free(node, sizeof(rnode));
+		} else {
+			if (len == cap) {
+				cap *= 2;
+				nodes = realloc(nodes, sizeof(rnode *) * cap);
+				if (nodes == NULL) die("realloc");
+			}
+
+			nodes[len++] = node;
+			span = line >= 0 ? node : NULL;
+		}
+
+		node = next;
+	}
+
+	rnode *root = NULL;
+	for (int k = 0; k < len; k++) {
+		nodes[k] -> left = nodes[k] -> right = nodes[k] -> parent = NULL;
+		row_node_update(nodes[k]);
+		root = row_node_merge(root, nodes[k]);
+	}
+
+	root -> parent = NULL;
+	Ed.buffer -> row_root = root;
+	free(nodes);
+}
+
+rstore *editor_row(int at) {
+	if (at < 0 || at >= Ed.buffer -> num_rows) return NULL;
+
+	int offset = 0;
+	rnode *node = row_node_find(at, &offset);
+	if (node -> span) {
+		pthread_rwlock_wrlock(&rows_lock);
+		rstore *row = editor_row_load(node, at - offset, offset);
+		pthread_rwlock_unlock(&rows_lock);
+
+		return row;
+	}
+
+	return &node -> row;
+}
+
+// Copies a row that still views the mapped file into memory of its own.
+void editor_row_make_editable(rstore *row) {
+	if (!editor_row_is_mapped(row)) return;
+
+	char *chars = pool_alloc(row -> size + 1);
+	memcpy(chars, row -> chars, row -> size);
+	chars[row -> size] = '\0';
+	row -> chars = chars;
+	row -> cap = row -> size + 1;
+}
+
+// Moves the gap of a chunked row to just before char at.
+void editor_row_move_gap(rstore *row, int at) {
+	struct RowChunks *chunks = row -> chunks;
+	if (at == chunks -> gap) return;
+
+	int gap_len = row -> cap - 1 - row -> size;
+	if (at < chunks -> gap) memmove(&row -> chars[at + gap_len], &row -> chars[at], chunks -> gap - at);
+	else memmove(&row -> chars[chunks -> gap], &row -> chars[chunks -> gap + gap_len], at - chunks -> gap);
+	chunks -> gap = at;
+
+	if (at == row -> size) {
+		row -> chars[at] = '\0';
+		if (Ed.buffer -> gap_row == row) Ed.buffer -> gap_row = NULL;
+
+		return;
+	}
+
+	rstore *open = Ed.buffer -> gap_row;
+	if (open && open != row) editor_row_move_gap(open, open -> size);
+	Ed.buffer -> gap_row = row;
+}
+
+// Closes the gap a buffer has open, for passes that read every row whole.
+void editor_rows_close_gap() {
+	rstore *row = Ed.buffer -> gap_row;
+	if (row) editor_row_move_gap(row, row -> size);
+}
+
+// Returns the row's chars laid out so that those from from to to are all
+// in place, and are indexed as usual. Moving the gap out from between
+// them takes no more than to - from chars.
+char *editor_row_span(rstore *row, int from, int to) {
+	struct RowChunks *chunks = row -> chunks;
+	if (chunks == NULL || chunks -> gap >= to) return row -> chars;
+
+	if (chunks -> gap > from) editor_row_move_gap(row, chunks -> gap - from < to - chunks -> gap ? from : to);
+
+	return chunks -> gap >= to ? row -> chars : row -> chars + row -> cap - 1 - row -> size;
+}
+
+// Makes room for len more chars. Rows grow by half again at least, so
+// typing into one does not reallocate it at every key.
+void editor_row_reserve(rstore *row, size_t len) {
+	size_t need = row -> size + len + 1;
+	if (need <= (size_t) row -> cap) return;
+
+	size_t cap = row -> cap + row -> cap / 2;
+	if (cap < need) cap = need;
+
+	// The gap takes all the room there is, so what is after it moves up.
+	int tail = row -> chunks ? row -> size - row -> chunks -> gap : 0;
+	row -> chars = pool_realloc(row -> chars, row -> cap, cap);
+	if (tail) memmove(&row -> chars[cap - 1 - tail], &row -> chars[row -> cap - 1 - tail], tail);
+	row -> cap = cap;
+}
+
+int editor_row_index(rstore *row) {
+	return row_node_position(ROW_NODE(row));
+}
+
+rstore *editor_row_next(rstore *row) {
+	rnode *node = row_node_next(ROW_NODE(row));
+
+	if (node && node -> span) return editor_row(editor_row_index(row) + 1);
+
+	return node ? &node -> row : NULL;
+}
+
+rstore *editor_row_prev(rstore *row) {
+	rnode *node = row_node_prev(ROW_NODE(row));
+
+	if (node && node -> span) return editor_row(editor_row_index(row) - 1);
+
+	return node ? &node -> row : NULL;
+}
+
+// Inserts count empty rows at at, which are built into a tree of their
+// own first and spliced in with a single split and merge.
+rstore *editor_row_store_insert(int at, int count) {
+	if (at < Ed.buffer -> num_rows) editor_row(at);
+
+	rnode *block = NULL;
+	for (int k = 0; k < count; k++) block = row_node_merge(block, row_node_new(0, 0));
+
+	rnode *first = block;
+	while (first -> left) first = first -> left;
+
+	rnode *l, *r;
+	pthread_rwlock_wrlock(&rows_lock);
+	row_node_split(Ed.buffer -> row_root, at, &l, &r);
+	Ed.buffer -> row_root = row_node_merge(row_node_merge(l, block), r);
+	Ed.buffer -> row_root -> parent = NULL;
+	Ed.buffer -> num_rows += count;
+	pthread_rwlock_unlock(&rows_lock);
+
+	return &first -> row;
+}
+
+void row_node_free(rnode *node) {
+	if (node == NULL) return;
+
+	row_node_free(node -> left);
+	row_node_free(node -> right);
+	pool_free(node, sizeof(rnode));
+}
+
+// Removes rows at to at + count - 1, whose data must already be freed.
+// Both ends must fall on node boundaries.
+void editor_row_store_remove(int at, int count) {
+	rnode *l, *m, *r;
+	pthread_rwlock_wrlock(&rows_lock);
+	row_node_split(Ed.buffer -> row_root, at, &l, &m);
+	row_node_split(m, count, &m, &r);
+	Ed.buffer -> row_root = row_node_merge(l, r);
+	if (Ed.buffer -> row_root) Ed.buffer -> row_root -> parent = NULL;
+	Ed.buffer -> num_rows -= count;
+	pthread_rwlock_unlock(&rows_lock);
+
+	row_node_free(m);
+}
+
+// Row cursors read rows in order without loading mapped spans, for passes
+// over the whole buffer such as saving. They hand out chars as they are,
+// so such passes close the buffer's gap first.
+void editor_row_cursor_seek(struct RowCursor *cursor, int at) {
+	cursor -> line = 0;
+	cursor -> node = (at < Ed.buffer -> num_rows) ? row_node_find(at, &cursor -> line) : NULL;
+}
+
+int editor_row_cursor_next(struct RowCursor *cursor, char **s, int *len) {
+	rnode *node = cursor -> node;
+	if (node == NULL) return 0;
+
+	if (node -> span) {
+		editor_map_line(node -> map_line + cursor -> line, s, len);
+		if (++cursor -> line < node -> span) return 1;
+	} else {
+		*s = node -> row.chars;
+		*len = node -> row.size;
+	}
+
+	cursor -> node = row_node_next(node);
+	cursor -> line = 0;
+
+	return 1;
+}
+
+// Unicode
+// Rows are taken as UTF-8. A byte that does not start a valid sequence
+// takes one column and is drawn like a control character. Most rows are
+// plain ASCII, so rows are checked for that 16 bytes at a time and then
+// handled exactly as they always were.
+struct WidthRange {
+	int first;
+	int last;
+};
+
+struct WidthRange zero_width[] = {
+	{0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf}, {0x05c1, 0x05c2},
+	{0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a}, {0x064b, 0x065f}, {0x0670, 0x0670},
+	{0x06d6, 0x06dc}, {0x06df, 0x06e4}, {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0900, 0x0902},
+	{0x093a, 0x093a}, {0x093c, 0x093c}, {0x0941, 0x0948}, {0x094d, 0x094d}, {0x0e31, 0x0e31},
+	{0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f},
+	{0x202a, 0x202e}, {0x2060, 0x2064}, {0x20d0, 0x20ff}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f},
+	{0xfeff, 0xfeff}, {0xe0100, 0xe01ef},
+};
+
+struct WidthRange double_width[] = {
+	{0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec}, {0x2614, 0x2615},
+	{0x2e80, 0x303e}, {0x3041, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0x9fff}, {0xa000, 0xa4cf},
+	{0xa960, 0xa97f}, {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6f},
+	{0xff00, 0xff60}, {0xffe0, 0xffe6}, {0x1f300, 0x1f64f}, {0x1f900, 0x1f9ff}, {0x20000, 0x2fffd},
+	{0x30000, 0x3fffd},
+};
+
+int editor_in_ranges(struct WidthRange *ranges, int count, int codepoint) {
+	int lo = 0, hi = count - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (codepoint < ranges[mid].first) hi = mid - 1;
+		else if (codepoint > ranges[mid].last) lo = mid + 1;
+		else return 1;
+	}
+
+	return 0;
+}
+
+// Returns the columns a codepoint takes on a terminal: 0 for combining
+// marks, 2 for East Asian wide chars and 1 for the rest.
+int editor_codepoint_width(int codepoint) {
+	if (codepoint < 0x300) return 1;
+	if (editor_in_ranges(zero_width, sizeof(zero_width) / sizeof(zero_width[0]), codepoint)) return 0;
+	if (editor_in_ranges(double_width, sizeof(double_width) / sizeof(double_width[0]), codepoint)) return 2;
+
+	return 1;
+}
+
+// Returns the length of the run of ASCII bytes s starts with.
+int editor_ascii_prefix(const char *s, int len) {
+	int i = 0;
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		unsigned int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (s + i)));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+#endif
+
+	while (i < len && !(s[i] & 0x80)) i++;
+
+	return i;
+}
+
+// Returns the length of the run of bytes s starts with that each take one
+// column: ASCII other than tabs.
+int editor_plain_prefix(const char *s, int len) {
+	int i = 0;
+#ifdef __SSE2__
+	__m128i tab = _mm_set1_epi8('\t');
+	for (; i + 16 <= len; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *) (s + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_or_si128(block, _mm_cmpeq_epi8(block, tab)));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+#endif
+
+	while (i < len && !(s[i] & 0x80) && s[i] != '\t') i++;
+
+	return i;
+}
+
+// Decodes the char s starts with, rejecting overlong forms, surrogates and
+// codepoints past U+10FFFF. Returns its length in bytes, or 0 when s does
+// not start a valid sequence.
+int editor_utf8_decode(const char *s, int len, int *codepoint) {
+	unsigned char c = s[0];
+	int n, cp, least;
+	if (c < 0x80) {
+		*codepoint = c;
+
+		return 1;
+	} else if ((c & 0xe0) == 0xc0) {
+		n = 2, cp = c & 0x1f, least = 0x80;
+	} else if ((c & 0xf0) == 0xe0) {
+		n = 3, cp = c & 0x0f, least = 0x800;
+	} else if ((c & 0xf8) == 0xf0) {
+		n = 4, cp = c & 0x07, least = 0x10000;
+	} else {
+		return 0;
+	}
+
+	if (n > len) return 0;
+	for (int k = 1; k < n; k++) {
+		if ((s[k] & 0xc0) != 0x80) return 0;
+		cp = (cp << 6) | (s[k] & 0x3f);
+	}
+
+	if (cp < least || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) return 0;
+	*codepoint = cp;
+
+	return n;
+}
+
+// Returns the length in bytes of the char s starts with; a byte that does
+// not start a valid sequence is a char on its own.
+int editor_char_len(const char *s, int len) {
+	int codepoint;
+	int n = editor_utf8_decode(s, len, &codepoint);
+
+	return n ? n : 1;
+}
+
+// Steps over the char s starts with, adding the columns it takes from *rx
+// on, and returns its length in bytes.
+int editor_char_step(const char *s, int len, int *rx) {
+	if (s[0] == '\t') {
+		*rx += DAVE_ED_TAB_STOP - *rx % DAVE_ED_TAB_STOP;
+
+		return 1;
+	}
+
+	int codepoint;
+	int n = editor_utf8_decode(s, len, &codepoint);
+	if (n == 0) {
+		(*rx)++;
+
+		return 1;
+	}
+
+	*rx += n == 1 ? 1 : editor_codepoint_width(codepoint);
+
+	return n;
+}
+
+// Renders the char s starts with at column *rx into render, and returns
+// the bytes it wrote; *used gets the bytes of s it took. Tabs become spaces
+// and invalid bytes DEL, which is drawn like a control character.
+int editor_render_char(char *render, const char *s, int len, int *rx, int *used) {
+	int start_rx = *rx;
+	*used = editor_char_step(s, len, rx);
+	if (s[0] == '\t') {
+		memset(render, ' ', *rx - start_rx);
+
+		return *rx - start_rx;
+	}
+
+	if (*used == 1 && (s[0] & 0x80)) {
+		render[0] = 0x7f;
+
+		return 1;
+	}
+
+	memcpy(render, s, *used);
+
+	return *used;
+}
+
+// Whether the row is plain ASCII is worked out once after each edit.
+int editor_row_is_ascii(rstore *row) {
+	if (row -> charset == ROW_UNCHECKED)
+		row -> charset = editor_ascii_prefix(editor_row_span(row, 0, row -> size), row -> size) == row -> size ? ROW_ASCII : ROW_UTF8;
+
+	return row -> charset == ROW_ASCII;
+}
+
+// Returns where the char holding byte cx of the row starts.
+int editor_row_char_start(rstore *row, int cx) {
+	if (cx <= 0 || cx >= row -> size) return cx;
+
+	char *chars = editor_row_span(row, cx > 3 ? cx - 3 : 0, cx + 4 < row -> size ? cx + 4 : row -> size);
+	int start = cx;
+	while (start > 0 && cx - start < 3 && (chars[start] & 0xc0) == 0x80) start--;
+	if (start < cx && start + editor_char_len(&chars[start], row -> size - start) > cx) return start;
+
+	return cx;
+}
+
+int editor_row_prev_char(rstore *row, int cx) {
+	return cx > 0 ? editor_row_char_start(row, cx - 1) : 0;
+}
+
+int editor_row_next_char(rstore *row, int cx) {
+	if (cx >= row -> size) return cx;
+
+	char *chars = editor_row_span(row, cx, cx + 4 < row -> size ? cx + 4 : row -> size);
+
+	return cx + editor_char_len(&chars[cx], row -> size - cx);
+}
+
+// Rows that are not plain ASCII are drawn from the window, a copy of the
+// render bytes that fall in the columns on screen.
+char *window_render;
+unsigned char *window_highlight;
+int window_len;
+int window_cap;
+
+void editor_window_append(const char *s, const unsigned char *highlight, int len) {
+	if (window_len + len > window_cap) {
+		window_cap = (window_len + len) * 2;
+		window_render = realloc(window_render, window_cap);
+		window_highlight = realloc(window_highlight, window_cap);
+		if (window_render == NULL || window_highlight == NULL) die("realloc");
+	}
+
+	memcpy(&window_render[window_len], s, len);
+	memcpy(&window_highlight[window_len], highlight, len);
+	window_len += len;
+}
+
+// Adds the chars of a render that starts at column rx which fall in the
+// columns [from, to). A wide char cut by the left edge leaves a space, and
+// zero width chars go with the char they follow.
+void editor_window_add(const char *render, const unsigned char *highlight, int rsize, int rx, int from, int to) {
+	int j = 0;
+	while (j < rsize && rx <= to) {
+		int run = editor_ascii_prefix(&render[j], rsize - j);
+		if (run) {
+			int lo = from > rx ? from - rx : 0;
+			int hi = to - rx < run ? to - rx : run;
+			if (hi > lo) editor_window_append(&render[j + lo], &highlight[j + lo], hi - lo);
+			rx += run;
+			j += run;
+
+			continue;
+		}
+
+		int width = 0;
+		int len = editor_char_step(&render[j], rsize - j, &width);
+		if ((rx > from || (rx == from && (width || from == 0))) && rx + width <= to) {
+			editor_window_append(&render[j], &highlight[j], len);
+		} else if (rx < from && rx + width > from) {
+			unsigned char normal = HL_NORMAL;
+			editor_window_append(" ", &normal, 1);
+		}
+
+		rx += width;
+		j += len;
+	}
+}
+
+// Syntax Highlighting
+unsigned char seperators[256];
+
+void editor_init_seperators() {
+	for (int c = 0; c < 256; c++)
+		seperators[c] = isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+int is_seperator(int c) {
+	return seperators[(unsigned char) c];
+}
+
+unsigned int keyword_hash(const char *s, int len, unsigned int seed) {
+	unsigned int h = 2166136261u ^ seed;
+	for (int i = 0; i < len; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 16777619u;
+	}
+
+	return h ^ (h >> 15);
+}
+
+// Tries seeds, then doubles the table, until no two keywords share a slot.
+// Keywords ending in '|' are KEYWORD2, as in the HLDB tables.
+struct KeywordTable *editor_compile_keywords(char **keywords) {
+	int n = 0;
+	while (keywords[n]) n++;
+
+	struct KeywordTable *table = calloc(1, sizeof(struct KeywordTable));
+	unsigned int size = 8;
+	while (size < 2 * (unsigned int) n) size <<= 1;
+
+	while (1) {
+		table -> words = realloc(table -> words, sizeof(char *) * size);
+		table -> lens = realloc(table -> lens, size);
+		table -> classes = realloc(table -> classes, size);
+		table -> mask = size - 1;
+
+		for (table -> seed = 0; table -> seed < 64; table -> seed++) {
+			memset(table -> words, 0, sizeof(char *) * size);
+			table -> min_len = 255;
+			table -> max_len = 0;
+
+			int j;
+			for (j = 0; j < n; j++) {
+				int klen = strlen(keywords[j]);
+				int keyword_two = keywords[j][klen - 1] == '|';
+				if (keyword_two) klen--;
+
+				unsigned int slot = keyword_hash(keywords[j], klen, table -> seed) & table -> mask;
+				if (table -> words[slot]) break;
+
+				table -> words[slot] = keywords[j];
+				table -> lens[slot] = klen;
+				table -> classes[slot] = keyword_two ? HL_KEYWORD2 : HL_KEYWORD1;
+				if (klen < table -> min_len) table -> min_len = klen;
+				if (klen > table -> max_len) table -> max_len = klen;
+			}
+
+			if (j == n) return table;
+		}
+
+		size <<= 1;
+	}
+}
+
+// Returns the highlight class of the word, or 0 when it is not a keyword.
+int editor_keyword_class(struct KeywordTable *table, const char *s, int len) {
+	if (len < table -> min_len || len > table -> max_len) return 0;
+
+	unsigned int slot = keyword_hash(s, len, table -> seed) & table -> mask;
+	if (table -> words[slot] && table -> lens[slot] == len && !memcmp(table -> words[slot], s, len))
+		return table -> classes[slot];
+
+	return 0;
+}
+
+// Syntax Definitions
+// A definition file has a directive a line, and '#' starts a comment line:
+//   name NAME                     as shown on the status bar
+//   match .EXT NAME...            the files it is for
+//   keywords WORD...              colored as KEYWORD1, types as KEYWORD2
+//   numbers                       colors numbers
+//   comment START [END]           runs to END, or else to the end of line
+//   string START END [escape C]
+//   code START END                where keywords and numbers count again
+// Rules marked multiline carry on past the end of a line, rules marked
+// word only start where a word can, and rules indented under a rule only
+// apply within the region it opens.
+
+// Rules are nested under the last rule indented less than them; indents
+// holds how far each was indented. Returns NULL, or what is wrong with the
+// line.
+char *editor_syntax_line(struct EditorSyntax *syntax, char *line, int *indents) {
+	const char *space = " \t\r\n";
+	int indent = strspn(line, " \t");
+	char *word = strtok(line, space);
+	if (word == NULL || word[0] == '#') return NULL;
+
+	if (!strcmp(word, "name")) {
+		char *name = strtok(NULL, space);
+		if (name == NULL) return "missing name";
+		if (strlen(name) > DAVE_ED_SYNTAX_NAME_MAX) return "name too long";
+
+		free(syntax -> file_type);
+		syntax -> file_type = strdup(name);
+	} else if (!strcmp(word, "match") || !strcmp(word, "keywords") || !strcmp(word, "types")) {
+		char ***list = word[0] == 'm' ? &syntax -> file_match : &syntax -> keywords;
+		int keyword_two = word[0] == 't';
+		int n = 0;
+		while ((*list)[n]) n++;
+
+		// Types go in with the '|' that marks KEYWORD2 for the keyword table.
+		while ((word = strtok(NULL, space))) {
+			*list = realloc(*list, sizeof(char *) * (n + 2));
+			(*list)[n] = malloc(strlen(word) + 2);
+			sprintf((*list)[n], keyword_two ? "%s|" : "%s", word);
+			(*list)[++n] = NULL;
+		}
+	} else if (!strcmp(word, "numbers")) {
+		syntax -> numbers = 1;
+	} else {
+		struct SyntaxRule rule = {0, NULL, NULL, 0, 0, -1, 0};
+		if (!strcmp(word, "comment")) rule.kind = RULE_COMMENT;
+		else if (!strcmp(word, "string")) rule.kind = RULE_STRING;
+		else if (!strcmp(word, "code")) rule.kind = RULE_CODE;
+		else return "unknown rule";
+
+		if (syntax -> num_rules == DAVE_ED_SYNTAX_RULES) return "too many rules";
+
+		rule.start = strtok(NULL, space);
+		if (rule.start == NULL) return "missing start delimiter";
+
+		while ((word = strtok(NULL, space))) {
+			if (!strcmp(word, "multiline")) {
+				rule.multiline = 1;
+			} else if (!strcmp(word, "word")) {
+				rule.word = 1;
+			} else if (!strcmp(word, "escape")) {
+				word = strtok(NULL, space);
+				if (word == NULL || word[1] != '\0') return "escape takes one char";
+
+				rule.escape = (unsigned char) word[0];
+			} else if (rule.end == NULL) {
+				rule.end = word;
+			} else {
+				return "too many delimiters";
+			}
+		}
+
+		if (rule.end == NULL && rule.kind != RULE_COMMENT) return "missing end delimiter";
+		if (rule.end == NULL && rule.multiline) return "multiline needs an end delimiter";
+
+		rule.start = strdup(rule.start);
+		if (rule.end) rule.end = strdup(rule.end);
+		rule.parent = syntax -> num_rules - 1;
+		while (rule.parent >= 0 && indents[rule.parent] >= indent) rule.parent = syntax -> rules[rule.parent].parent;
+
+		syntax -> rules = realloc(syntax -> rules, sizeof(struct SyntaxRule) * (syntax -> num_rules + 1));
+		indents[syntax -> num_rules] = indent;
+		syntax -> rules[syntax -> num_rules++] = rule;
+	}
+
+	return NULL;
+}
+
+void editor_free_syntax(struct EditorSyntax *syntax) {
+	for (int k = 0; syntax -> file_match[k]; k++) free(syntax -> file_match[k]);
+	for (int k = 0; syntax -> keywords[k]; k++) free(syntax -> keywords[k]);
+	for (int k = 0; k < syntax -> num_rules; k++) {
+		free(syntax -> rules[k].start);
+		free(syntax -> rules[k].end);
+	}
+
+	free(syntax -> file_type);
+	free(syntax -> file_match);
+	free(syntax -> keywords);
+	free(syntax -> rules);
+	free(syntax);
+}
+
+// Reads a definition, reporting what is wrong with a bad one on the status
+// bar and returning NULL.
+struct EditorSyntax *editor_read_syntax(FILE *file_pointer, const char *path) {
+	struct EditorSyntax *syntax = calloc(1, sizeof(struct EditorSyntax));
+	syntax -> file_match = calloc(1, sizeof(char *));
+	syntax -> keywords = calloc(1, sizeof(char *));
+
+	int indents[DAVE_ED_SYNTAX_RULES];
+	char *line = NULL, *error = NULL;
+	size_t line_cap = 0;
+	int line_number = 0;
+
+	while (error == NULL && getline(&line, &line_cap, file_pointer) != -1) {
+		line_number++;
+		error = editor_syntax_line(syntax, line, indents);
+	}
+
+	free(line);
+	if (error == NULL && syntax -> file_type == NULL) error = "missing name";
+
+	if (error) {
+		editor_set_status_message("%s:%d: %s", path, line_number, error);
+		editor_free_syntax(syntax);
+
+		return NULL;
+	}
+
+	return syntax;
+}
+
+void editor_add_syntax(struct EditorSyntax *syntax) {
+	for (int k = 0; k < hldb_len; k++) {
+		if (!strcmp(HLDB[k] -> file_type, syntax -> file_type)) {
+			editor_free_syntax(syntax);
+
+			return;
+		}
+	}
+
+	HLDB = realloc(HLDB, sizeof(struct EditorSyntax *) * (hldb_len + 1));
+	HLDB[hldb_len++] = syntax;
+}
+
+void editor_load_syntax_dir(const char *dir) {
+	struct dirent **entries;
+	int count = scandir(dir, &entries, NULL, alphasort);
+	if (count == -1) return;
+
+	for (int k = 0; k < count; k++) {
+		char *name = entries[k] -> d_name;
+		int len = strlen(name);
+		if (len > 7 && !strcmp(&name[len - 7], ".syntax")) {
+			char *path = malloc(strlen(dir) + len + 2);
+			sprintf(path, "%s/%s", dir, name);
+
+			FILE *file_pointer = fopen(path, "r");
+			if (file_pointer) {
+				struct EditorSyntax *syntax = editor_read_syntax(file_pointer, path);
+				if (syntax) editor_add_syntax(syntax);
+				fclose(file_pointer);
+			}
+
+			free(path);
+		}
+
+		free(entries[k]);
+	}
+
+	free(entries);
+}
+
+void editor_load_syntaxes() {
+	if (HLDB) return;
+
+	char *home = getenv("HOME");
+	if (home) {
+		char *dir = malloc(strlen(home) + sizeof(DAVE_ED_SYNTAX_DIR) + 1);
+		sprintf(dir, "%s/%s", home, DAVE_ED_SYNTAX_DIR);
+		editor_load_syntax_dir(dir);
+		free(dir);
+	}
+
+	// The binary is found through /proc where there is one, and otherwise
+	// through the path it was run by.
+	char exe[4096];
+	ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - sizeof("/syntax"));
+	if (len <= 0 && Ed.program && strchr(Ed.program, '/')) {
+		char *path = realpath(Ed.program, NULL);
+		len = path && strlen(path) < sizeof(exe) - sizeof("/syntax") ? (ssize_t) strlen(path) : -1;
+		if (len > 0) memcpy(exe, path, len);
+		free(path);
+	}
+
+	char *slash = len > 0 ? memrchr(exe, '/', len) : NULL;
+	if (slash) {
+		strcpy(slash, "/syntax");
+		editor_load_syntax_dir(exe);
+	}
+
+	// Builds made with make SYNTAX_DIR=... look where they are installed.
+#ifdef DAVE_ED_SYSTEM_SYNTAX_DIR
+	editor_load_syntax_dir(DAVE_ED_SYSTEM_SYNTAX_DIR);
+#endif
+
+	FILE *file_pointer = fmemopen(C_HL_definition, sizeof(C_HL_definition) - 1, "r");
+	if (file_pointer == NULL) die("fmemopen");
+
+	editor_add_syntax(editor_read_syntax(file_pointer, "builtin"));
+	fclose(file_pointer);
+}
+
+int editor_lexer_node(struct SyntaxLexer *lexer) {
+	int node = lexer -> num_nodes++;
+	lexer -> next = realloc(lexer -> next, sizeof(int) * lexer -> num_nodes * lexer -> num_classes);
+	lexer -> accept = realloc(lexer -> accept, sizeof(int) * lexer -> num_nodes);
+	if (lexer -> next == NULL || lexer -> accept == NULL) die("realloc");
+
+	memset(&lexer -> next[node * lexer -> num_classes], 0, sizeof(int) * lexer -> num_classes);
+	lexer -> accept[node] = -1;
+
+	return node;
+}
+
+// Adds a delimiter to the trie of a context. Where two rules share one,
+// the first added wins.
+void editor_lexer_add(struct SyntaxLexer *lexer, int context, const char *delimiter, struct SyntaxToken token) {
+	if (lexer -> contexts[context].root == 0) lexer -> contexts[context].root = editor_lexer_node(lexer);
+
+	int node = lexer -> contexts[context].root;
+	for (const unsigned char *p = (const unsigned char *) delimiter; *p; p++) {
+		int at = node * lexer -> num_classes + lexer -> classes[*p];
+		if (lexer -> next[at] == 0) {
+			int child = editor_lexer_node(lexer);
+			lexer -> next[at] = child;
+		}
+
+		node = lexer -> next[at];
+	}
+
+	// Reading a delimiter looks at the byte after it, which for an escape
+	// is taken along too.
+	int len = strlen(delimiter);
+	if (len + 1 > lexer -> reach) lexer -> reach = len + 1;
+
+	if (lexer -> accept[node] >= 0) return;
+
+	lexer -> tokens = realloc(lexer -> tokens, sizeof(struct SyntaxToken) * (lexer -> num_tokens + 1));
+	lexer -> tokens[lexer -> num_tokens] = token;
+	lexer -> accept[node] = lexer -> num_tokens++;
+}
+
+// Within a region its escape comes first, then its end delimiter and then
+// the start delimiters of the rules nested in it.
+struct SyntaxLexer *editor_compile_lexer(struct EditorSyntax *syntax) {
+	struct SyntaxLexer *lexer = calloc(1, sizeof(struct SyntaxLexer));
+	lexer -> contexts = calloc(syntax -> num_rules + 1, sizeof(struct SyntaxContext));
+	lexer -> contexts[0].code = 1;
+
+	// Bytes found in no delimiter all fall in class 0.
+	lexer -> num_classes = 1;
+	for (int r = 0; r < syntax -> num_rules; r++) {
+		struct SyntaxRule *rule = &syntax -> rules[r];
+		char escape[2] = {rule -> escape, '\0'};
+		char *delimiters[] = {rule -> start, rule -> end ? rule -> end : "", escape};
+
+		for (int d = 0; d < 3; d++)
+			for (unsigned char *p = (unsigned char *) delimiters[d]; *p; p++)
+				if (lexer -> classes[*p] == 0) lexer -> classes[*p] = lexer -> num_classes++;
+	}
+
+	editor_lexer_node(lexer);
+
+	for (int r = 0; r < syntax -> num_rules; r++) {
+		struct SyntaxRule *rule = &syntax -> rules[r];
+		struct SyntaxContext *context = &lexer -> contexts[r + 1];
+		if (rule -> kind == RULE_STRING) context -> highlight = HL_STRING;
+		else if (rule -> kind == RULE_COMMENT) context -> highlight = rule -> multiline ? HL_MLCOMMENT : HL_COMMENT;
+		context -> code = rule -> kind == RULE_CODE;
+		context -> line_end = rule -> multiline ? r + 1 : lexer -> contexts[rule -> parent + 1].line_end;
+	}
+
+	for (int r = -1; r < syntax -> num_rules; r++) {
+		if (r >= 0) {
+			struct SyntaxRule *rule = &syntax -> rules[r];
+			unsigned char highlight = lexer -> contexts[r + 1].highlight;
+			char escape[2] = {rule -> escape, '\0'};
+
+			if (rule -> escape) editor_lexer_add(lexer, r + 1, escape, (struct SyntaxToken) {r + 1, highlight, 1, 0});
+			if (rule -> end) editor_lexer_add(lexer, r + 1, rule -> end, (struct SyntaxToken) {rule -> parent + 1, highlight, 0, 0});
+		}
+
+		for (int k = r + 1; k < syntax -> num_rules; k++) {
+			if (syntax -> rules[k].parent != r) continue;
+
+			struct SyntaxToken token = {k + 1, lexer -> contexts[k + 1].highlight, 0, syntax -> rules[k].word};
+			editor_lexer_add(lexer, r + 1, syntax -> rules[k].start, token);
+		}
+	}
+
+	return lexer;
+}
+
+void editor_compile_syntax(struct EditorSyntax *syntax) {
+	if (syntax -> lexer) return;
+
+	syntax -> keyword_table = editor_compile_keywords(syntax -> keywords);
+	syntax -> lexer = editor_compile_lexer(syntax);
+}
+
+// Colors n chars from at, clipped to the end of the range being scanned.
+#define SCAN_MARK(at, n, class) do { \
+		int mark_end = (at) + (n) < end ? (at) + (n) : end; \
+		if (highlight && mark_end > (at)) memset(&highlight[(at) - start], (class), mark_end - (at)); \
+	} while (0)
+
+// Scans text[start, end) of a line of len chars on from state, and leaves
+// the state at end in it. highlight holds the colors of text[start, end)
+// only: tokens are still read up to len, but are colored up to end, and
+// what they cover past it is carried over to the next range. Colors are
+// only worked out when highlight is not NULL, since numbers and keywords
+// never change the context.
+void editor_syntax_scan_range(char *text, int len, int start, int end, unsigned char *highlight, struct ScanState *state) {
+	struct KeywordTable *keywords = Ed.buffer -> syntax -> keyword_table;
+	struct SyntaxLexer *lexer = Ed.buffer -> syntax -> lexer;
+	int num_classes = lexer -> num_classes;
+	int numbers = Ed.buffer -> syntax -> numbers;
+
+	struct SyntaxContext *context = &lexer -> contexts[state -> context];
+	int previous_seperator = state -> previous_seperator;
+	unsigned char previous_highlight = state -> previous_highlight;
+	int i = start + state -> carry;
+
+	if (highlight) {
+		memset(highlight, HL_NORMAL, end - start);
+		SCAN_MARK(start, state -> carry, state -> carry_highlight);
+	}
+
+	while (i < end) {
+		// Nothing ends a line comment before the line does.
+		if (context -> root == 0 && !context -> code) {
+			SCAN_MARK(i, end - i, context -> highlight);
+			previous_highlight = context -> highlight;
+			i = end;
+
+			break;
+		}
+
+		int token = -1, token_end = i;
+		int word_start = i == 0 || is_seperator(text[i - 1]);
+		for (int j = i, node = context -> root; node && j < len; j++) {
+			node = lexer -> next[node * num_classes + lexer -> classes[(unsigned char) text[j]]];
+			if (lexer -> accept[node] >= 0 && (word_start || !lexer -> tokens[lexer -> accept[node]].word)) {
+				token = lexer -> accept[node];
+				token_end = j + 1;
+			}
+		}
+
+		if (token >= 0) {
+			struct SyntaxToken *read = &lexer -> tokens[token];
+			if (read -> escape && token_end < len) token_end++;
+
+			SCAN_MARK(i, token_end - i, read -> highlight);
+			context = &lexer -> contexts[read -> context];
+			previous_seperator = 1;
+			previous_highlight = read -> highlight;
+			i = token_end;
+
+			continue;
+		}
+
+		if (!context -> code) {
+			if (highlight) highlight[i - start] = context -> highlight;
+			previous_highlight = context -> highlight;
+			i++;
+
+			continue;
+		}
+
+		if (highlight == NULL) {
+			i++;
+
+			continue;
+		}
+
+		char c = text[i];
+
+		if (numbers) {
+			if ((isdigit(c) && (previous_seperator || previous_highlight == HL_NUMBER)) || (c == '.' && previous_highlight == HL_NUMBER)) {
+				highlight[i - start] = HL_NUMBER;
+				i++;
+				previous_seperator = 0;
+				previous_highlight = HL_NUMBER;
+				continue;
+			}
+		}
+
+		if (previous_seperator) {
+			// Words longer than any keyword need not be read to their end.
+			int klen = 0;
+			while (i + klen < len && klen <= keywords -> max_len && !is_seperator(text[i + klen])) klen++;
+
+			int keyword_class = editor_keyword_class(keywords, &text[i], klen);
+			if (keyword_class) {
+				SCAN_MARK(i, klen, keyword_class);
+				i += klen;
+				previous_seperator = 0;
+				previous_highlight = keyword_class;
+
+				continue;
+			}
+		}
+
+		previous_seperator = is_seperator(c);
+		previous_highlight = HL_NORMAL;
+		i++;
+	}
+
+	state -> context = context - lexer -> contexts;
+	state -> previous_seperator = previous_seperator;
+	state -> previous_highlight = previous_highlight;
+	state -> carry = i > end ? i - end : 0;
+	state -> carry_highlight = state -> carry ? previous_highlight : HL_NORMAL;
+}
+
+#undef SCAN_MARK
+
+// Returns the lexer state the line after one ending in context starts in.
+int editor_syntax_line_end(int context) {
+	return Ed.buffer -> syntax -> lexer -> contexts[context].line_end;
+}
+
+// Scans one line from the given lexer state and returns the state at its
+// end.
+int editor_syntax_scan(char *text, int len, unsigned char *highlight, int context) {
+	struct ScanState state = SCAN_STATE_INIT(context);
+	editor_syntax_scan_range(text, len, 0, len, highlight, &state);
+
+	return editor_syntax_line_end(state.context);
+}
+
+void editor_update_syntax(rstore *row) {
+	row -> highlight = realloc(row -> highlight, row -> rsize);
+	memset(row -> highlight, HL_NORMAL, row -> rsize);
+
+	if (Ed.buffer -> syntax == NULL) return;
+
+	long long start = editor_probe_start();
+	int entry = ROW_NODE(row) -> hl_entry;
+	editor_syntax_scan(row -> render, row -> rsize, row -> highlight, entry > 0 ? entry : 0);
+	editor_probe_end("update_syntax", start, STATS_SYNTAX);
+}
+
+int row_node_exit_state(rnode *node) {
+	if (node -> span) return Ed.buffer -> map_line_state[node -> map_line + node -> span - 1];
+
+	return node -> row.highlight_exit_state;
+}
+
+// Brings the lexer state of every row above upto up to date. Work starts
+// at the frontier, the first row whose state may be wrong, and skips ahead
+// to the next stale node as soon as states converge with what was there.
+// Rows past upto are left stale, so an edit only costs the rows on screen.
+void editor_syntax_settle(int upto) {
+	if (Ed.buffer -> syntax == NULL) return;
+	if (upto > Ed.buffer -> num_rows) upto = Ed.buffer -> num_rows;
+
+	while (Ed.buffer -> syntax_frontier < upto) {
+		int at = Ed.buffer -> syntax_frontier;
+		int offset = 0;
+		rnode *node = row_node_find(at, &offset);
+		if (offset > 0) {
+			pthread_rwlock_wrlock(&rows_lock);
+			node = editor_span_cut(node, at - offset, offset);
+			pthread_rwlock_unlock(&rows_lock);
+		}
+
+		rnode *previous = row_node_prev(node);
+		int state = previous ? row_node_exit_state(previous) : 0;
+
+		if (!node -> syntax_stale && node -> hl_entry == state) {
+			rnode *stale = row_node_first_stale();
+			Ed.buffer -> syntax_frontier = stale ? row_node_position(stale) : Ed.buffer -> num_rows;
+
+			continue;
+		}
+
+		if (node -> span) {
+			if (at + node -> span > upto) {
+				pthread_rwlock_wrlock(&rows_lock);
+				rnode *rest = editor_span_cut(node, at, upto - at);
+				pthread_rwlock_unlock(&rows_lock);
+				row_node_set_stale(rest, 1);
+			}
+
+			int entry = state;
+			int old_state = node -> hl_entry;
+			for (int k = 0; k < node -> span; k++) {
+				if (node -> hl_entry >= 0 && state == old_state) break;
+
+				int line = node -> map_line + k;
+				char *s;
+				int len;
+				editor_map_line(line, &s, &len);
+				old_state = Ed.buffer -> map_line_state[line];
+				state = editor_syntax_scan(s, len, NULL, state);
+				Ed.buffer -> map_line_state[line] = state;
+			}
+
+			node -> hl_entry = entry;
+		} else {
+			rstore *row = &node -> row;
+			if (node -> hl_entry != state) row -> render_stale = 1;
+			node -> hl_entry = state;
+			if (editor_row_chunked(row)) row -> highlight_exit_state = editor_chunks_settle(row, state);
+			else row -> highlight_exit_state = editor_syntax_scan(row -> chars, row -> size, NULL, state);
+		}
+
+		row_node_set_stale(node, 0);
+		Ed.buffer -> syntax_frontier = at + row_node_weight(node);
+	}
+
+	if (Ed.buffer -> syntax_frontier < Ed.buffer -> num_rows) {
+		int offset = 0;
+		row_node_set_stale(row_node_find(Ed.buffer -> syntax_frontier, &offset), 1);
+	}
+}
+
+int editor_syntax_to_color(int highlight) {
+	switch (highlight) {
+		case HL_COMMENT: 
+		case HL_MLCOMMENT: return 36;
+		case HL_KEYWORD1: return 34;
+		case HL_KEYWORD2: return 32;
+		case HL_STRING: return 35;
+		case HL_NUMBER: return 31;
+		case HL_MATCH: return 34;
+		default: return 37;
+	}
+}
+
+void editor_select_syntax_highlight() {
+	Ed.buffer -> syntax = NULL;
+	if (Ed.buffer -> file_name == NULL) return;
+
+	char *ext = strrchr(Ed.buffer -> file_name, '.');
+
+	for (int j = 0; j < hldb_len; j++) {
+		struct EditorSyntax *s = HLDB[j];
+		unsigned int i = 0;
+
+		while (s -> file_match[i]) {
+			int is_ext = (s -> file_match[i][0] == '.');
+			if ((is_ext && ext && !strcmp(ext, s -> file_match[i])) || (!is_ext && strstr(Ed.buffer -> file_name, s -> file_match[i]))) {
+				Ed.buffer -> syntax = s;
+				editor_compile_syntax(s);
+
+				row_node_mark_all_stale(Ed.buffer -> row_root);
+				Ed.buffer -> syntax_frontier = 0;
+				Ed.syntax_generation++;
+				for (int k = 0; k < Ed.render_cache_len; k++)
+					Ed.render_cache[k] -> render_stale = 1;
+
+				return;
+			}
+
+			i++;
+		}
+	}
+}
+
+// Row Chunks
+// Chunk scans and renders color into chunk_classes a char at a time before
+// the tabs are expanded.
+unsigned char *chunk_classes;
+int chunk_classes_cap;
+
+unsigned char *editor_chunk_classes(int len) {
+	if (len > chunk_classes_cap) {
+		chunk_classes_cap = len;
+		chunk_classes = realloc(chunk_classes, chunk_classes_cap);
+		if (chunk_classes == NULL) die("realloc");
+	}
+
+	return chunk_classes;
+}
+
+// Returns the render column just past a chunk that starts at rx.
+int editor_chunk_end_rx(struct RenderChunk *chunk, int rx) {
+	if (chunk -> after_tab < 0) return rx + chunk -> lead;
+
+	rx += chunk -> lead;
+	rx += DAVE_ED_TAB_STOP - rx % DAVE_ED_TAB_STOP;
+
+	return rx + chunk -> after_tab;
+}
+
+void editor_chunk_drop_render(struct RenderChunk *chunk) {
+	free(chunk -> render);
+	free(chunk -> highlight);
+	chunk -> render = NULL;
+	chunk -> highlight = NULL;
+	chunk -> render_align = -1;
+}
+
+// Opens a blank chunk at k, to be laid out and scanned.
+void editor_chunks_insert(struct RowChunks *chunks, int k) {
+	if (chunks -> count == chunks -> cap) {
+		chunks -> cap = chunks -> cap ? chunks -> cap * 2 : 16;
+		chunks -> chunk = realloc(chunks -> chunk, sizeof(struct RenderChunk) * chunks -> cap);
+		if (chunks -> chunk == NULL) die("realloc");
+	}
+
+	memmove(&chunks -> chunk[k + 1], &chunks -> chunk[k], sizeof(struct RenderChunk) * (chunks -> count - k));
+	chunks -> count++;
+
+	struct RenderChunk *chunk = &chunks -> chunk[k];
+	memset(chunk, 0, sizeof(struct RenderChunk));
+	chunk -> render_align = -1;
+	chunk -> layout_stale = 1;
+	chunk -> scan_stale = 1;
+}
+
+void editor_chunks_remove(struct RowChunks *chunks, int k) {
+	editor_chunk_drop_render(&chunks -> chunk[k]);
+	memmove(&chunks -> chunk[k], &chunks -> chunk[k + 1], sizeof(struct RenderChunk) * (chunks -> count - k - 1));
+	chunks -> count--;
+}
+
+// Marks a chunk whose text changed. The chunk before it is rescanned too,
+// since its last token may reach into this one.
+void editor_chunks_touch(struct RowChunks *chunks, int k) {
+	struct RenderChunk *chunk = &chunks -> chunk[k];
+	editor_chunk_drop_render(chunk);
+	chunk -> layout_stale = 1;
+	chunk -> scan_stale = 1;
+	if (k > 0) chunks -> chunk[k - 1].scan_stale = 1;
+	chunks -> rx_stale = 1;
+}
+
+// Returns the chunk holding char cx.
+int editor_chunks_find(struct RowChunks *chunks, int cx) {
+	int lo = 0, hi = chunks -> count - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (chunks -> chunk[mid].start <= cx) lo = mid;
+		else hi = mid - 1;
+	}
+
+	return lo;
+}
+
+// Returns the chunk holding render column rx, once laid out.
+int editor_chunks_find_rx(struct RowChunks *chunks, int rx) {
+	int lo = 0, hi = chunks -> count - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (chunks -> chunk[mid].rx <= rx) lo = mid;
+		else hi = mid - 1;
+	}
+
+	return lo;
+}
+
+void editor_row_chunk(rstore *row) {
+	if (row -> render) {
+		editor_render_cache_remove(row);
+		editor_row_evict(row);
+	}
+
+	struct RowChunks *chunks = calloc(1, sizeof(struct RowChunks));
+	if (chunks == NULL) die("calloc");
+	chunks -> generation = Ed.syntax_generation;
+	chunks -> rx_stale = 1;
+	chunks -> gap = row -> size;
+
+	// Chunks start on char boundaries.
+	for (int start = 0, k = 0; start < row -> size; k++) {
+		int end = start + DAVE_ED_RENDER_CHUNK;
+		end = row -> size - end < DAVE_ED_RENDER_CHUNK ? row -> size : editor_row_char_start(row, end);
+		editor_chunks_insert(chunks, k);
+		chunks -> chunk[k].start = start;
+		chunks -> chunk[k].len = end - start;
+		start = end;
+	}
+
+	row -> chunks = chunks;
+}
+
+void editor_row_unchunk(rstore *row) {
+	editor_row_move_gap(row, row -> size);
+	if (Ed.buffer -> gap_row == row) Ed.buffer -> gap_row = NULL;
+
+	struct RowChunks *chunks = row -> chunks;
+	if (chunks -> cached) editor_render_cache_remove(row);
+	for (int k = 0; k < chunks -> count; k++) editor_chunk_drop_render(&chunks -> chunk[k]);
+
+	free(chunks -> chunk);
+	free(chunks);
+	row -> chunks = NULL;
+	row -> render_stale = 1;
+}
+
+// Splits rows into chunks once they reach DAVE_ED_RENDER_CHUNK chars, and
+// joins them up again when they shrink well below that.
+int editor_row_chunked(rstore *row) {
+	if (row -> chunks && (row -> size < DAVE_ED_RENDER_CHUNK / 2 || row -> chunks -> generation != Ed.syntax_generation))
+		editor_row_unchunk(row);
+	if (row -> chunks == NULL && row -> size >= DAVE_ED_RENDER_CHUNK) editor_row_chunk(row);
+
+	return row -> chunks != NULL;
+}
+
+// Moves the chunk boundaries after delta chars were inserted at at, or
+// -delta chars deleted from there. Chunks are kept between half and twice
+// DAVE_ED_RENDER_CHUNK chars, so the work an edit leaves is bounded.
+void editor_chunks_edit(rstore *row, int at, int delta) {
+	struct RowChunks *chunks = row -> chunks;
+	int k = editor_chunks_find(chunks, at);
+
+	// What is left of the chunks a deletion runs over ends up in the first.
+	if (delta < 0) {
+		while (k + 1 < chunks -> count && chunks -> chunk[k + 1].start < at - delta) {
+			chunks -> chunk[k].len += chunks -> chunk[k + 1].len;
+			editor_chunks_remove(chunks, k + 1);
+		}
+	}
+
+	chunks -> chunk[k].len += delta;
+	for (int j = k + 1; j < chunks -> count; j++) chunks -> chunk[j].start += delta;
+
+	if (chunks -> chunk[k].len < DAVE_ED_RENDER_CHUNK / 2 && chunks -> count > 1) {
+		if (k + 1 == chunks -> count) k--;
+		chunks -> chunk[k].len += chunks -> chunk[k + 1].len;
+		editor_chunks_remove(chunks, k + 1);
+	}
+
+	editor_chunks_touch(chunks, k);
+	while (chunks -> chunk[k].len > 2 * DAVE_ED_RENDER_CHUNK) {
+		int cut = editor_row_char_start(row, chunks -> chunk[k].start + DAVE_ED_RENDER_CHUNK);
+		editor_chunks_insert(chunks, k + 1);
+		chunks -> chunk[k + 1].start = cut;
+		chunks -> chunk[k + 1].len = chunks -> chunk[k].start + chunks -> chunk[k].len - cut;
+		chunks -> chunk[k].len = cut - chunks -> chunk[k].start;
+		k++;
+	}
+}
+
+// Lays the chars out for scanning a chunk. A token that starts in it is
+// read on past its end, and a word delimiter looks at the char before it.
+char *editor_chunk_scan_text(rstore *row, struct RenderChunk *chunk) {
+	struct EditorSyntax *syntax = Ed.buffer -> syntax;
+	int reach = syntax -> lexer -> reach;
+	if (syntax -> keyword_table -> max_len + 1 > reach) reach = syntax -> keyword_table -> max_len + 1;
+
+	int to = chunk -> start + chunk -> len + reach;
+
+	return editor_row_span(row, chunk -> start > 0 ? chunk -> start - 1 : 0, to < row -> size ? to : row -> size);
+}
+
+// Rescans chunk k from its entry state, passing the state it ends in on to
+// the next chunk, which needs rescanning in turn if that changed it.
+void editor_chunks_scan(rstore *row, int k) {
+	struct RowChunks *chunks = row -> chunks;
+	struct RenderChunk *chunk = &chunks -> chunk[k];
+	struct ScanState state = chunk -> entry;
+
+	// Numbers and keywords are worked out too, since the state after them
+	// is part of what the next chunk starts from.
+	editor_syntax_scan_range(editor_chunk_scan_text(row, chunk), row -> size, chunk -> start, chunk -> start + chunk -> len,
+							 editor_chunk_classes(chunk -> len), &state);
+	editor_chunk_drop_render(chunk);
+	chunk -> scan_stale = 0;
+
+	if (k + 1 == chunks -> count) {
+		chunks -> exit_state = editor_syntax_line_end(state.context);
+	} else if (memcmp(&state, &chunk[1].entry, sizeof(state))) {
+		chunk[1].entry = state;
+		chunk[1].scan_stale = 1;
+	}
+}
+
+// Brings the chunk states of a row up to date from the state it starts in,
+// and returns the lexer state the next row starts in.
+int editor_chunks_settle(rstore *row, int context) {
+	struct RowChunks *chunks = row -> chunks;
+	struct ScanState entry = SCAN_STATE_INIT(context);
+	if (memcmp(&entry, &chunks -> chunk[0].entry, sizeof(entry))) {
+		chunks -> chunk[0].entry = entry;
+		chunks -> chunk[0].scan_stale = 1;
+	}
+
+	for (int k = 0; k < chunks -> count; k++)
+		if (chunks -> chunk[k].scan_stale) editor_chunks_scan(row, k);
+
+	return chunks -> exit_state;
+}
+
+// Works out the render column each chunk starts at, measuring only the
+// chunks that changed.
+void editor_chunks_layout(rstore *row) {
+	struct RowChunks *chunks = row -> chunks;
+	if (!chunks -> rx_stale) return;
+
+	int rx = 0;
+	for (int k = 0; k < chunks -> count; k++) {
+		struct RenderChunk *chunk = &chunks -> chunk[k];
+		if (chunk -> layout_stale) {
+			char *s = editor_row_span(row, chunk -> start, chunk -> start + chunk -> len) + chunk -> start;
+			int columns = 0, lead = -1;
+			for (int j = 0; j < chunk -> len; ) {
+				int run = editor_plain_prefix(&s[j], chunk -> len - j);
+				columns += run;
+				j += run;
+				if (j == chunk -> len) break;
+
+				if (s[j] == '\t' && lead < 0) {
+					lead = columns;
+					columns = 0;
+					j++;
+				} else if (s[j] == '\t') {
+					columns += DAVE_ED_TAB_STOP - columns % DAVE_ED_TAB_STOP;
+					j++;
+				} else {
+					j += editor_char_step(&s[j], chunk -> len - j, &columns);
+				}
+			}
+
+			chunk -> lead = lead < 0 ? columns : lead;
+			chunk -> after_tab = lead < 0 ? -1 : columns;
+			chunk -> layout_stale = 0;
+		}
+
+		chunk -> rx = rx;
+		rx = editor_chunk_end_rx(chunk, rx);
+	}
+
+	chunks -> rsize = rx;
+	chunks -> rx_stale = 0;
+}
+
+// Builds the render and highlight of chunk k. A render only depends on the
+// chunk's text, entry state and where its columns fall between tab stops.
+void editor_chunks_render(rstore *row, int k) {
+	struct RowChunks *chunks = row -> chunks;
+	struct RenderChunk *chunk = &chunks -> chunk[k];
+	int align = chunk -> rx % DAVE_ED_TAB_STOP;
+	if (chunk -> render && chunk -> render_align == align) return;
+
+	long long start = editor_probe_start();
+	unsigned char *classes = editor_chunk_classes(chunk -> len);
+	if (Ed.buffer -> syntax) {
+		struct ScanState state = chunk -> entry;
+		editor_syntax_scan_range(editor_chunk_scan_text(row, chunk), row -> size, chunk -> start, chunk -> start + chunk -> len, classes, &state);
+	} else {
+		memset(classes, HL_NORMAL, chunk -> len);
+	}
+
+	// Tabs take a byte a column and other chars no more than their bytes.
+	int rsize = chunk -> len + editor_chunk_end_rx(chunk, chunk -> rx) - chunk -> rx;
+	chunk -> render = realloc(chunk -> render, rsize + 1);
+	chunk -> highlight = realloc(chunk -> highlight, rsize + 1);
+	if (chunk -> render == NULL || chunk -> highlight == NULL) die("realloc");
+
+	char *s = editor_row_span(row, chunk -> start, chunk -> start + chunk -> len) + chunk -> start;
+	int idx = 0, rx = chunk -> rx, len;
+	for (int j = 0; j < chunk -> len; j += len) {
+		len = editor_plain_prefix(&s[j], chunk -> len - j);
+		if (len) {
+			memcpy(&chunk -> render[idx], &s[j], len);
+			memcpy(&chunk -> highlight[idx], &classes[j], len);
+			idx += len;
+			rx += len;
+
+			continue;
+		}
+
+		int n = editor_render_char(&chunk -> render[idx], &s[j], chunk -> len - j, &rx, &len);
+		memset(&chunk -> highlight[idx], classes[j], n);
+		idx += n;
+	}
+
+	chunk -> rsize = idx;
+	chunk -> render_align = align;
+	if (!chunks -> cached) {
+		editor_render_cache_add(row);
+		chunks -> cached = 1;
+	}
+
+	editor_probe_end("update_syntax", start, STATS_SYNTAX);
+}
+
+// Gathers the columns of a chunked row that are on screen into the window,
+// rendering the chunks they fall in and dropping the others.
+int editor_chunks_window(rstore *row, char **render, unsigned char **highlight) {
+	struct RowChunks *chunks = row -> chunks;
+	int from = Ed.view.column_offset;
+	int to = from + Ed.screen_cols;
+
+	window_len = 0;
+	int first = editor_chunks_find_rx(chunks, from);
+	for (int k = 0; k < chunks -> count; k++) {
+		struct RenderChunk *chunk = &chunks -> chunk[k];
+		if (k < first || chunk -> rx > to) {
+			if (chunk -> render) editor_chunk_drop_render(chunk);
+
+			continue;
+		}
+
+		editor_chunks_render(row, k);
+		editor_window_add(chunk -> render, chunk -> highlight, chunk -> rsize, chunk -> rx, from, to);
+	}
+
+	*render = window_render;
+	*highlight = window_highlight;
+
+	return window_len;
+}
+
+// Row Operations
+struct ColumnIndex *editor_row_columns(rstore *row) {
+	if (row -> columns) return row -> columns;
+
+	// Tabs and bytes past ASCII bound the stops from above; the index is
+	// cut down once the chars are known.
+	unsigned char *s = (unsigned char *) editor_row_span(row, 0, row -> size);
+	int size = row -> size;
+	int count = 0;
+	for (int j = 0; j < size; j++) count += (s[j] == '\t') | (s[j] >> 7);
+
+	struct ColumnIndex *columns = malloc(sizeof(struct ColumnIndex) + sizeof(struct ColumnStop) * count);
+	if (columns == NULL) die("malloc");
+
+	// Tabs render as spaces, one byte a column; other chars keep their
+	// bytes, but for invalid ones, which become one.
+	int rx = 0, ro = 0, previous = 0, k = 0;
+	for (int j = 0; (j += editor_plain_prefix((char *) &s[j], size - j)) < size; k++) {
+		rx += j - previous;
+		ro += j - previous;
+
+		int start_rx = rx;
+		int len = 1;
+		if (s[j] == '\t') {
+			rx += DAVE_ED_TAB_STOP - rx % DAVE_ED_TAB_STOP;
+			ro += rx - start_rx;
+		} else {
+			len = editor_char_step((char *) &s[j], size - j, &rx);
+			ro += len;
+		}
+
+		columns -> stops[k].cx = j;
+		columns -> stops[k].len = len;
+		columns -> stops[k].rx = rx;
+		columns -> stops[k].ro = ro;
+		j += len;
+		previous = j;
+	}
+
+	if (k < count) {
+		struct ColumnIndex *cut = realloc(columns, sizeof(struct ColumnIndex) + sizeof(struct ColumnStop) * k);
+		if (cut != NULL) columns = cut;
+	}
+	columns -> num_stops = k;
+	row -> columns = columns;
+
+	return columns;
+}
+
+// Returns the last stop before char cx, or NULL when there is none.
+struct ColumnStop *editor_row_stop_before(rstore *row, int cx) {
+	struct ColumnIndex *columns = editor_row_columns(row);
+	int lo = 0, hi = columns -> num_stops;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (columns -> stops[mid].cx < cx) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo ? &columns -> stops[lo - 1] : NULL;
+}
+
+int editor_row_cx_to_rx(rstore *row, int cx) {
+	if (row -> chunks) {
+		editor_chunks_layout(row);
+		struct RenderChunk *chunk = &row -> chunks -> chunk[editor_chunks_find(row -> chunks, cx)];
+		int end = chunk -> start + chunk -> len;
+		char *chars = editor_row_span(row, chunk -> start, end);
+		int rx = chunk -> rx;
+		for (int j = chunk -> start; j < cx; ) {
+			int run = editor_plain_prefix(&chars[j], cx - j);
+			j += run;
+			rx += run;
+			if (j < cx) j += editor_char_step(&chars[j], end - j, &rx);
+		}
+
+		return rx;
+	}
+
+	if (row -> size >= DAVE_ED_COLUMN_INDEX_MIN || !editor_row_is_ascii(row)) {
+		struct ColumnStop *stop = editor_row_stop_before(row, cx);
+		if (stop == NULL) return cx;
+
+		int past = cx - stop -> cx - stop -> len;
+
+		return stop -> rx + (past > 0 ? past : 0);
+	}
+
+	int rx = 0;
+	int j = -1;
+	for (j = 0; j < cx; j++) {
+		if (row -> chars[j] == '\t')
+			rx += (DAVE_ED_TAB_STOP - 1) - (rx % DAVE_ED_TAB_STOP);
+		rx++;
+	}
+
+	return rx;
+}
+
+// Returns the offset in the row's render that char cx is drawn from.
+int editor_row_cx_to_ro(rstore *row, int cx) {
+	if (editor_row_is_ascii(row)) return editor_row_cx_to_rx(row, cx);
+
+	struct ColumnStop *stop = editor_row_stop_before(row, cx);
+	if (stop == NULL) return cx;
+
+	int past = cx - stop -> cx - stop -> len;
+
+	return stop -> ro + (past > 0 ? past : 0);
+}
+
+int editor_row_rx_to_cx(rstore *row, int rx) {
+	int cur_rx = 0;
+	int cx = 0;
+	if (row -> chunks) {
+		editor_chunks_layout(row);
+		struct RenderChunk *chunk = &row -> chunks -> chunk[editor_chunks_find_rx(row -> chunks, rx)];
+		int end = chunk -> start + chunk -> len;
+		char *chars = editor_row_span(row, chunk -> start, end);
+		for (cx = chunk -> start, cur_rx = chunk -> rx; cx < end; ) {
+			int run = editor_plain_prefix(&chars[cx], end - cx);
+			if (cur_rx + run > rx) return cx + (rx > cur_rx ? rx - cur_rx : 0);
+
+			cx += run;
+			cur_rx += run;
+			if (cx == end) break;
+
+			int len = editor_char_step(&chars[cx], end - cx, &cur_rx);
+			if (cur_rx > rx) return cx;
+			cx += len;
+		}
+
+		return cx;
+	}
+
+	if (row -> size >= DAVE_ED_COLUMN_INDEX_MIN || !editor_row_is_ascii(row)) {
+		struct ColumnIndex *columns = editor_row_columns(row);
+		int lo = 0, hi = columns -> num_stops;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (columns -> stops[mid].rx <= rx) lo = mid + 1;
+			else hi = mid;
+		}
+
+		// Past the last stop wholly left of rx, unless rx is inside the next.
+		struct ColumnStop *stop = lo ? &columns -> stops[lo - 1] : NULL;
+		cx = stop ? stop -> cx + stop -> len + rx - stop -> rx : rx;
+		if (lo < columns -> num_stops && cx > columns -> stops[lo].cx) cx = columns -> stops[lo].cx;
+
+		return cx < row -> size ? cx : row -> size;
+	}
+
+	for (; cx < row -> size; cx++) {
+		if (row -> chars[cx] == '\t')
+			cur_rx += (DAVE_ED_TAB_STOP - 1) - (cur_rx % DAVE_ED_TAB_STOP);
+		cur_rx++;
+
+		if (cur_rx > rx) return cx;
+	}
+
+	return cx;
+}
+
+// Gathers the part of a row that is not plain ASCII that is on screen into
+// the window.
+int editor_row_window(rstore *row, char **render, unsigned char **highlight) {
+	int cx = editor_row_rx_to_cx(row, Ed.view.column_offset);
+	int ro = editor_row_cx_to_ro(row, cx);
+
+	window_len = 0;
+	editor_window_add(&row -> render[ro], &row -> highlight[ro], row -> rsize - ro, editor_row_cx_to_rx(row, cx),
+					  Ed.view.column_offset, Ed.view.column_offset + Ed.screen_cols);
+	*render = window_render;
+	*highlight = window_highlight;
+
+	return window_len;
+}
+
+// Render and highlight are only built for rows that get drawn, and are
+// rebuilt lazily after an edit marks them stale.
+void editor_update_row(rstore *row) {
+	free(row -> columns);
+	row -> columns = NULL;
+	row -> charset = ROW_UNCHECKED;
+	row -> render_stale = 1;
+	row_node_set_stale(ROW_NODE(row), 1);
+
+	int at = editor_row_index(row);
+	if (at < Ed.buffer -> syntax_frontier) Ed.buffer -> syntax_frontier = at;
+}
+
+void editor_render_cache_add(rstore *row) {
+	if (Ed.render_cache_len == Ed.render_cache_cap) {
+		Ed.render_cache_cap = Ed.render_cache_cap ? Ed.render_cache_cap * 2 : 64;
+		Ed.render_cache = realloc(Ed.render_cache, sizeof(rstore *) * Ed.render_cache_cap);
+		if (Ed.render_cache == NULL) die("realloc");
+	}
+
+	Ed.render_cache[Ed.render_cache_len++] = row;
+}
+
+void editor_render_cache_remove(rstore *row) {
+	for (int k = 0; k < Ed.render_cache_len; k++) {
+		if (Ed.render_cache[k] == row) {
+			Ed.render_cache[k] = Ed.render_cache[--Ed.render_cache_len];
+
+			return;
+		}
+	}
+}
+
+void editor_row_evict(rstore *row) {
+	if (row -> chunks) {
+		for (int k = 0; k < row -> chunks -> count; k++) editor_chunk_drop_render(&row -> chunks -> chunk[k]);
+		row -> chunks -> cached = 0;
+	}
+
+	free(row -> render);
+	free(row -> highlight);
+	row -> render = NULL;
+	row -> highlight = NULL;
+	row -> rsize = 0;
+	row -> render_stale = 1;
+}
+
+// Drops render data of rows that have scrolled more than a screen away.
+void editor_render_cache_trim() {
+	if (Ed.render_cache_len <= DAVE_ED_RENDER_CACHE_SCREENS * Ed.screen_rows) return;
+
+	int top = Ed.view.row_offset - Ed.screen_rows;
+	int bottom = Ed.view.row_offset + 2 * Ed.screen_rows;
+	int k = 0;
+	while (k < Ed.render_cache_len) {
+		rstore *row = Ed.render_cache[k];
+		int at = editor_row_index(row);
+
+		if (at < top || at >= bottom) {
+			editor_row_evict(row);
+			Ed.render_cache[k] = Ed.render_cache[--Ed.render_cache_len];
+		} else {
+			k++;
+		}
+	}
+}
+
+// Chunked rows only get their chunk states and columns brought up to date
+// here; chunks are rendered as they are drawn.
+void editor_row_prepare(rstore *row) {
+	if (editor_row_chunked(row)) {
+		int entry = ROW_NODE(row) -> hl_entry;
+		if (Ed.buffer -> syntax) editor_chunks_settle(row, entry > 0 ? entry : 0);
+		editor_chunks_layout(row);
+
+		return;
+	}
+
+	if (row -> render && !row -> render_stale) return;
+
+	if (row -> render == NULL) editor_render_cache_add(row);
+
+	row -> render_stale = 0;
+
+	int tabs = 0;
+	int j = -1;
+	for (j = 0; j < row -> size; j++)
+		if (row -> chars[j] == '\t') tabs++;
+
+	free(row -> render);
+	row -> render = malloc(row -> size + tabs * (DAVE_ED_TAB_STOP - 1) + 1);
+
+	int idx = 0;
+	if (editor_row_is_ascii(row)) {
+		for (j = 0; j < row -> size; j++) {
+			if (row -> chars[j] == '\t') {
+				row -> render[idx++] = ' ';
+				while (idx % DAVE_ED_TAB_STOP != 0) row -> render[idx++] = ' ';
+			} else {
+				row -> render[idx++] = row -> chars[j];
+			}
+		}
+	} else {
+		// Runs of plain ASCII between the other chars are copied whole.
+		int rx = 0, len;
+		for (j = 0; j < row -> size; j += len) {
+			len = editor_plain_prefix(&row -> chars[j], row -> size - j);
+			if (len) {
+				memcpy(&row -> render[idx], &row -> chars[j], len);
+				idx += len;
+				rx += len;
+
+				continue;
+			}
+
+			idx += editor_render_char(&row -> render[idx], &row -> chars[j], row -> size - j, &rx, &len);
+		}
+	}
+
+	row -> render[idx] = '\0';
+	row -> rsize = idx;
+
+	editor_update_syntax(row);
+}
+
+// Every change to the text goes through the four primitives below, which
+// hand it on to the journal and the undo log as an EditRecord.
+void editor_record_edit(int op, int row, int at, const char *s, int len) {
+	editor_journal_record(op, row, at, s, len);
+	editor_undo_record(op, row, at, s, len);
+}
+
+// Row text in edit records is packed as each row's length, an int, then
+// its chars, so rows holding '\n' or any other byte replay as they were.
+// Returns the number of rows packed in s, or -1 when s is cut short.
+int editor_rows_packed(const char *s, size_t len) {
+	int count = 0;
+	for (size_t k = 0; k < len; count++) {
+		int row_len;
+		if (len - k < sizeof(int)) return -1;
+
+		memcpy(&row_len, s + k, sizeof(int));
+		if (row_len < 0 || (size_t) row_len > len - k - sizeof(int)) return -1;
+
+		k += sizeof(int) + row_len;
+	}
+
+	return count;
+}
+
+// Inserts the rows packed in s from at on.
+void editor_insert_packed_rows(int at, const char *s, size_t len) {
+	int count = editor_rows_packed(s, len);
+	if (at < 0 || at > Ed.buffer -> num_rows || count <= 0) return;
+
+	rstore *row = editor_row_store_insert(at, count);
+	const char *p = s;
+	for (int k = 0; k < count; k++) {
+		memcpy(&row -> size, p, sizeof(int));
+		p += sizeof(int);
+
+		row -> chars = pool_alloc(row -> size + 1);
+		row -> cap = row -> size + 1;
+		memcpy(row -> chars, p, row -> size);
 		row -> chars[row -> size] = '\0';
+		p += row -> size;
+
+		row -> rsize = 0;
+		row -> render = NULL;
+		row -> highlight = NULL;
+		row -> highlight_exit_state = 0;
 		editor_update_row(row);
+
+		if (k + 1 < count) row = &row_node_next(ROW_NODE(row)) -> row;
+	}
+
+	Ed.buffer -> unsaved_changes_flag++;
+	editor_record_edit(EDIT_INSERT_ROWS, at, 0, s, len);
+}
+
+// Inserts the lines of s, separated by '\n', as rows from at on.
+void editor_insert_rows(int at, const char *s, size_t len) {
+	int count = 1;
+	for (const char *p = s; (p = memchr(p, '\n', s + len - p)); p++) count++;
+
+	char *packed = malloc(len + sizeof(int) * count);
+	if (packed == NULL) die("malloc");
+
+	char *out = packed;
+	const char *line = s;
+	for (int k = 0; k < count; k++) {
+		const char *end = memchr(line, '\n', s + len - line);
+		if (end == NULL) end = s + len;
+
+		int line_len = end - line;
+		memcpy(out, &line_len, sizeof(int));
+		memcpy(out + sizeof(int), line, line_len);
+		out += sizeof(int) + line_len;
+		line = end + 1;
+	}
+
+	editor_insert_packed_rows(at, packed, out - packed);
+	free(packed);
+}
+
+// Inserts s as a single row, whatever bytes it holds.
+void editor_insert_row(int at, char *s, size_t len) {
+	char *packed = malloc(sizeof(int) + len);
+	if (packed == NULL) die("malloc");
+
+	int row_len = len;
+	memcpy(packed, &row_len, sizeof(int));
+	memcpy(packed + sizeof(int), s, len);
+	editor_insert_packed_rows(at, packed, sizeof(int) + len);
+	free(packed);
+}
+
+void editor_free_row(rstore *row) {
+	if (row -> chunks) editor_row_unchunk(row);
+	if (row -> render) editor_render_cache_remove(row);
+	free(row -> render);
+	if (!editor_row_is_mapped(row)) pool_free(row -> chars, row -> cap);
+	free(row -> highlight);
+	free(row -> columns);
+}
+
+// Packs rows at to at + count - 1, without loading mapped spans.
+char *editor_rows_pack(int at, int count, size_t *len) {
+	struct RowCursor cursor;
+	char *s;
+	int line_len;
+	size_t total = 0;
+
+	editor_rows_close_gap();
+	editor_row_cursor_seek(&cursor, at);
+	for (int k = 0; k < count && editor_row_cursor_next(&cursor, &s, &line_len); k++) total += sizeof(int) + line_len;
+
+	char *text = malloc(total ? total : 1);
+	char *p = text;
+	editor_row_cursor_seek(&cursor, at);
+	for (int k = 0; k < count && editor_row_cursor_next(&cursor, &s, &line_len); k++) {
+		memcpy(p, &line_len, sizeof(int));
+		memcpy(p + sizeof(int), s, line_len);
+		p += sizeof(int) + line_len;
+	}
+
+	*len = total;
+
+	return text;
+}
+
+void editor_delete_rows(int at, int count) {
+	if (at < 0 || count <= 0 || at + count > Ed.buffer -> num_rows) return;
+
+	size_t len;
+	char *text = editor_rows_pack(at, count, &len);
+	editor_record_edit(EDIT_DELETE_ROWS, at, 0, text, len);
+	free(text);
+
+	// Loading the end rows cuts any mapped spans there, so the range starts
+	// and ends on node boundaries; spans inside it just go.
+	editor_row(at);
+	editor_row(at + count - 1);
+
+	int offset = 0;
+	rnode *node = row_node_find(at, &offset);
+	for (int covered = 0; covered < count; node = row_node_next(node)) {
+		if (!node -> span) editor_free_row(&node -> row);
+		covered += row_node_weight(node);
+	}
+
+	editor_row_store_remove(at, count);
+	if (at < Ed.buffer -> syntax_frontier) Ed.buffer -> syntax_frontier = at;
+	Ed.buffer -> unsaved_changes_flag++;
+}
+
+void editor_delete_row(int at) {
+	editor_delete_rows(at, 1);
+}
+
+void editor_row_insert_text(rstore *row, int at, const char *s, size_t len) {
+	if (at < 0 || at > row -> size) at = row -> size;
+	editor_row_make_editable(row);
+	editor_row_reserve(row, len);
+
+	if (row -> chunks) {
+		editor_row_move_gap(row, at);
+		memcpy(&row -> chars[at], s, len);
+		row -> chunks -> gap += len;
+		row -> size += len;
+		if (row -> chunks -> gap == row -> size) row -> chars[row -> size] = '\0';
+		editor_chunks_edit(row, at, len);
+	} else {
+		memmove(&row -> chars[at + len], &row -> chars[at], row -> size - at + 1);
+		memcpy(&row -> chars[at], s, len);
+		row -> size += len;
+	}
+
+	editor_update_row(row);
+	Ed.buffer -> unsaved_changes_flag++;
+	editor_record_edit(EDIT_INSERT_TEXT, editor_row_index(row), at, s, len);
+}
+
+void editor_row_delete_text(rstore *row, int at, int len) {
+	if (at < 0 || at >= row -> size || len <= 0) return;
+	if (len > row -> size - at) len = row -> size - at;
+	editor_row_make_editable(row);
+
+	// With the gap moved up to them, the chars deleted just join it.
+	if (row -> chunks) {
+		editor_row_move_gap(row, at);
+		editor_record_edit(EDIT_DELETE_TEXT, editor_row_index(row), at, &row -> chars[row -> cap - 1 - row -> size + at], len);
+		row -> size -= len;
+		if (at == row -> size) row -> chars[at] = '\0';
+		editor_chunks_edit(row, at, -len);
+	} else {
+		editor_record_edit(EDIT_DELETE_TEXT, editor_row_index(row), at, &row -> chars[at], len);
+		memmove(&row -> chars[at], &row -> chars[at + len], row -> size - at - len + 1);
+		row -> size -= len;
+	}
+
+	editor_update_row(row);
+	Ed.buffer -> unsaved_changes_flag++;
+}
+
+void editor_row_insert_character(rstore *row, int at, int c) {
+	char ch = c;
+	editor_row_insert_text(row, at, &ch, 1);
+}
+
+void editor_row_append_string(rstore *row, char *s, size_t len) {
+	editor_row_insert_text(row, row -> size, s, len);
+}
+
+void editor_row_delete_character(rstore *row, int at) {
+	editor_row_delete_text(row, at, 1);
+}
+
+// Applies an edit as recorded, or undoes it when inverse is set.
+// Returns -1 when it does not fit the buffer.
+int editor_apply_edit(struct EditRecord *record, char *text, int inverse) {
+	int op = record -> op;
+	if (inverse) op = (op == EDIT_INSERT_ROWS) ? EDIT_DELETE_ROWS : (op == EDIT_DELETE_ROWS) ? EDIT_INSERT_ROWS :
+					  (op == EDIT_INSERT_TEXT) ? EDIT_DELETE_TEXT : (op == EDIT_DELETE_TEXT) ? EDIT_INSERT_TEXT : 0;
+
+	rstore *row = NULL;
+	if ((op == EDIT_INSERT_TEXT || op == EDIT_DELETE_TEXT) && (row = editor_row(record -> row)) == NULL) return -1;
+
+	int count = 0;
+	if (op == EDIT_INSERT_ROWS || op == EDIT_DELETE_ROWS) {
+		count = editor_rows_packed(text, record -> len);
+		if (count <= 0 || record -> row < 0) return -1;
+	}
+
+	switch (op) {
+		case EDIT_INSERT_ROWS:
+			if (record -> row > Ed.buffer -> num_rows) return -1;
+			editor_insert_packed_rows(record -> row, text, record -> len);
+			break;
+		case EDIT_DELETE_ROWS:
+			if (record -> row + count > Ed.buffer -> num_rows) return -1;
+			editor_delete_rows(record -> row, count);
+			break;
+		case EDIT_INSERT_TEXT:
+			if (record -> at < 0 || record -> at > row -> size) return -1;
+			editor_row_insert_text(row, record -> at, text, record -> len);
+			break;
+		case EDIT_DELETE_TEXT:
+			if (record -> at < 0 || record -> at + record -> len > row -> size) return -1;
+			editor_row_delete_text(row, record -> at, record -> len);
+			break;
+		default:
+			return -1;
+	}
+
+	return 0;
+}
+
+// Editor Operations
+void editor_insert_character(int c) {
+	if (Ed.view.cy == Ed.buffer -> num_rows) {
+		editor_insert_row(Ed.buffer -> num_rows, "", 0);
+	}
+
+	editor_row_insert_character(editor_row(Ed.view.cy), Ed.view.cx, c);
+	Ed.view.cx++;
+}
+
+void editor_insert_new_line() {
+	if (Ed.view.cx == 0) {
+		editor_insert_row(Ed.view.cy, "", 0);
+	} else {
+		rstore *row = editor_row(Ed.view.cy);
+		char *chars = editor_row_span(row, Ed.view.cx, row -> size);
+		editor_insert_row(Ed.view.cy + 1, &chars[Ed.view.cx], row -> size - Ed.view.cx);
+		editor_row_delete_text(row, Ed.view.cx, row -> size - Ed.view.cx);
+	}
+
+	Ed.view.cy++;
+	Ed.view.cx = 0;
+}
+
+// Splices text in at the cursor as one block: its first line joins the
+// cursor's row and the rest go in as rows in a single batch, so however
+// much is pasted, each row is highlighted once and the screen drawn once.
+void editor_insert_text(const char *s, size_t len) {
+	if (Ed.view.cy == Ed.buffer -> num_rows) editor_insert_row(Ed.buffer -> num_rows, "", 0);
+
+	rstore *row = editor_row(Ed.view.cy);
+	const char *newline = memchr(s, '\n', len);
+	if (newline == NULL) {
+		editor_row_insert_text(row, Ed.view.cx, s, len);
+		Ed.view.cx += len;
+
+		return;
+	}
+
+	// The rest of the cursor's row moves to the end of the last line.
+	size_t head = newline - s;
+	size_t rest = len - head - 1;
+	size_t tail = row -> size - Ed.view.cx;
+	char *block = malloc(rest + tail + 1);
+	memcpy(block, newline + 1, rest);
+	memcpy(block + rest, &editor_row_span(row, Ed.view.cx, row -> size)[Ed.view.cx], tail);
+
+	int lines = 0;
+	const char *last = s;
+	for (const char *p = s; (p = memchr(p, '\n', s + len - p)); last = ++p) lines++;
+
+	editor_row_delete_text(row, Ed.view.cx, tail);
+	editor_row_insert_text(row, Ed.view.cx, s, head);
+	editor_insert_rows(Ed.view.cy + 1, block, rest + tail);
+	free(block);
+
+	Ed.view.cy += lines;
+	Ed.view.cx = s + len - last;
+}
+
+void editor_delete_character() {
+	if (Ed.view.cy == Ed.buffer -> num_rows) return;
+	if (Ed.view.cx == 0 && Ed.view.cy == 0) return;
+
+	rstore *row = editor_row(Ed.view.cy);
+	if (Ed.view.cx > 0) {
+		int start = editor_row_prev_char(row, Ed.view.cx);
+		editor_row_delete_text(row, start, Ed.view.cx - start);
+		Ed.view.cx = start;
+	} else {
+		rstore *previous_row = editor_row_prev(row);
+		Ed.view.cx = previous_row -> size;
+		editor_row_append_string(previous_row, editor_row_span(row, 0, row -> size), row -> size);
+		editor_delete_row(Ed.view.cy);
+		Ed.view.cy--;
+	}
+}
+
+// Journal
+// Every change to the rows is appended to a journal beside the file as a
+// small binary record. Records are collected in memory and committed to
+// disk together at most every DAVE_ED_JOURNAL_COMMIT_MS, so autosaving
+// costs as much as the edits made, however big the file. The header names
+// the version of the file the edits apply to, and after a crash they are
+// replayed on top of it.
+#define JOURNAL_MAGIC "DAVEJ003"
+
+struct JournalHeader {
+	char magic[8];
+	long long size;
+	long long mtime_sec;
+	long long mtime_nsec;
+};
+
+long long editor_now_ms() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// The journal for dir/name is dir/.name.journal.
+char *editor_journal_path(char *file_name) {
+	char *slash = strrchr(file_name, '/');
+	int dir_len = slash ? slash - file_name + 1 : 0;
+	char *path = malloc(strlen(file_name) + 10);
+	sprintf(path, "%.*s.%s.journal", dir_len, file_name, file_name + dir_len);
+
+	return path;
+}
+
+// The header names the file as it was when it was opened or last saved,
+// which is what the edits apply to even if it has changed on disk since.
+// Returns -1 for a buffer with no such file.
+int editor_journal_header(struct JournalHeader *header) {
+	if (!Ed.buffer -> journal.file_known) return -1;
+
+	struct stat *st = &Ed.buffer -> journal.file_stat;
+	memset(header, 0, sizeof(struct JournalHeader));
+	memcpy(header -> magic, JOURNAL_MAGIC, 8);
+	header -> size = st -> st_size;
+	header -> mtime_sec = st -> st_mtim.tv_sec;
+	header -> mtime_nsec = st -> st_mtim.tv_nsec;
+
+	return 0;
+}
+
+// Started on the first edit.
+void editor_journal_open() {
+	struct JournalHeader header;
+	if (Ed.buffer -> file_name == NULL || editor_journal_header(&header) == -1) return;
+
+	char *path = editor_journal_path(Ed.buffer -> file_name);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1 || write(fd, &header, sizeof(header)) != sizeof(header)) {
+		if (fd != -1) close(fd);
+		free(path);
+
+		return;
+	}
+
+	Ed.buffer -> journal.fd = fd;
+	Ed.buffer -> journal.path = path;
+	Ed.buffer -> journal.last_commit = editor_now_ms();
+}
+
+void editor_journal_commit() {
+	if (Ed.buffer -> journal.fd == -1 || Ed.buffer -> journal.pending_len == 0) return;
+
+	int written = 0;
+	while (written < Ed.buffer -> journal.pending_len) {
+		ssize_t n = write(Ed.buffer -> journal.fd, Ed.buffer -> journal.pending + written, Ed.buffer -> journal.pending_len - written);
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1) {
+			editor_set_status_message("Journal write failed: %s", strerror(errno));
+			break;
+		}
+
+		written += n;
+	}
+
+	fdatasync(Ed.buffer -> journal.fd);
+	Ed.buffer -> journal.pending_len = 0;
+	Ed.buffer -> journal.last_commit = editor_now_ms();
+}
+
+void editor_journal_record(int op, int row, int at, const char *s, int len) {
+	if (Ed.buffer -> journal.suspended) return;
+	if (Ed.buffer -> journal.fd == -1) editor_journal_open();
+	if (Ed.buffer -> journal.fd == -1) return;
+
+	struct EditRecord record = {op, row, at, len};
+	int size = sizeof(record) + len;
+	if (Ed.buffer -> journal.pending_len + size > Ed.buffer -> journal.pending_cap) {
+		while (Ed.buffer -> journal.pending_len + size > Ed.buffer -> journal.pending_cap) Ed.buffer -> journal.pending_cap = Ed.buffer -> journal.pending_cap ? Ed.buffer -> journal.pending_cap * 2 : 4096;
+		Ed.buffer -> journal.pending = realloc(Ed.buffer -> journal.pending, Ed.buffer -> journal.pending_cap);
+	}
+
+	memcpy(Ed.buffer -> journal.pending + Ed.buffer -> journal.pending_len, &record, sizeof(record));
+	if (len) memcpy(Ed.buffer -> journal.pending + Ed.buffer -> journal.pending_len + sizeof(record), s, len);
+	Ed.buffer -> journal.pending_len += size;
+
+	if (editor_now_ms() - Ed.buffer -> journal.last_commit >= DAVE_ED_JOURNAL_COMMIT_MS) editor_journal_commit();
+}
+
+// Milliseconds until pending edits are due to be committed, or -1.
+int editor_journal_timeout() {
+	if (Ed.buffer -> journal.pending_len == 0) return -1;
+
+	long long left = Ed.buffer -> journal.last_commit + DAVE_ED_JOURNAL_COMMIT_MS - editor_now_ms();
+
+	return left > 0 ? left : 0;
+}
+
+// Commits edits left pending once typing pauses.
+void editor_journal_poll() {
+	if (Ed.buffer -> journal.pending_len && editor_now_ms() - Ed.buffer -> journal.last_commit >= DAVE_ED_JOURNAL_COMMIT_MS) editor_journal_commit();
+}
+
+// Drops the journal once its edits are saved or thrown away.
+void editor_journal_discard() {
+	if (Ed.buffer -> journal.fd != -1) {
+		close(Ed.buffer -> journal.fd);
+		unlink(Ed.buffer -> journal.path);
+	}
+
+	free(Ed.buffer -> journal.path);
+	Ed.buffer -> journal.fd = -1;
+	Ed.buffer -> journal.path = NULL;
+	Ed.buffer -> journal.pending_len = 0;
+}
+
+// Offers to replay a journal left behind for the file just opened. Edits
+// replayed stay in the journal, which carries on from its last whole
+// record.
+void editor_journal_recover() {
+	if (Ed.buffer -> file_name == NULL) return;
+
+	char *path = editor_journal_path(Ed.buffer -> file_name);
+	int fd = open(path, O_RDWR);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		if (fd != -1) close(fd);
+		free(path);
+
+		return;
+	}
+
+	size_t len = st.st_size;
+	char *buffer = malloc(len ? len : 1);
+	size_t got = 0;
+	ssize_t n;
+	while (got < len && (n = read(fd, buffer + got, len - got)) > 0) got += n;
+
+	struct JournalHeader header, current;
+	if (got < sizeof(header) || editor_journal_header(&current) == -1 || memcmp(buffer, &current, sizeof(header))) {
+		editor_set_status_message("Ignoring a journal that does not match %s", Ed.buffer -> file_name);
+		close(fd);
+		free(buffer);
+		free(path);
+
+		return;
+	}
+
+	char *answer = editor_prompt("Unsaved edits to this file were found. Replay them? (y/n): %s", NULL);
+	int replay = answer && (answer[0] == 'y' || answer[0] == 'Y');
+	free(answer);
+
+	if (!replay) {
+		close(fd);
+		unlink(path);
+		free(buffer);
+		free(path);
+
+		return;
+	}
+
+	size_t offset = sizeof(header);
+	int applied = 0;
+	struct EditRecord record;
+	Ed.buffer -> journal.suspended = 1;
+	while (offset + sizeof(record) <= got) {
+		memcpy(&record, buffer + offset, sizeof(record));
+		if (record.len < 0 || offset + sizeof(record) + record.len > got) break;
+		if (editor_apply_edit(&record, buffer + offset + sizeof(record), 0) == -1) break;
+
+		offset += sizeof(record) + record.len;
+		applied++;
+	}
+	Ed.buffer -> journal.suspended = 0;
+
+	// Whatever follows the last whole record was cut off mid-write.
+	if (ftruncate(fd, offset) == -1 || lseek(fd, offset, SEEK_SET) == -1) {
+		close(fd);
+		fd = -1;
+	}
+
+	Ed.buffer -> journal.fd = fd;
+	Ed.buffer -> journal.path = path;
+	Ed.buffer -> journal.last_commit = editor_now_ms();
+	if (fd == -1) editor_journal_discard();
+	free(buffer);
+	editor_set_status_message("Replayed %d edits from the journal", applied);
+}
+
+// Undo
+// Edits are logged in an arena, each entry an EditRecord with its text and
+// followed by the entry's size, so the log can be walked from its end.
+// Entries made while handling one keypress share a group and are undone
+// together. Typing or deleting a run of characters keeps extending one
+// entry, so undoing even a long run is a single memmove and re-highlight.
+// The oldest groups are dropped once the log outgrows DAVE_ED_UNDO_BYTES.
+struct UndoEntry {
+	struct EditRecord record;
+	int group;
+	int cx;
+	int cy;
+	int after_cx;
+	int after_cy;
+};
+
+size_t undo_entry_size(int len) {
+	return ((sizeof(struct UndoEntry) + len + 7) & ~(size_t) 7) + sizeof(size_t);
+}
+
+struct UndoEntry *undo_last(struct UndoLog *log) {
+	if (log -> len == 0) return NULL;
+
+	size_t size;
+	memcpy(&size, log -> data + log -> len - sizeof(size_t), sizeof(size_t));
+
+	return (struct UndoEntry *) (log -> data + log -> len - size);
+}
+
+void undo_reserve(struct UndoLog *log, size_t len) {
+	if (len <= log -> cap) return;
+
+	while (log -> cap < len) log -> cap = log -> cap ? log -> cap * 2 : 4096;
+	log -> data = realloc(log -> data, log -> cap);
+	if (log -> data == NULL) die("realloc");
+}
+
+void undo_push(struct UndoLog *log, struct UndoEntry *entry, const char *text) {
+	size_t size = undo_entry_size(entry -> record.len);
+	undo_reserve(log, log -> len + size);
+
+	char *p = log -> data + log -> len;
+	memcpy(p, entry, sizeof(struct UndoEntry));
+	if (entry -> record.len) memcpy(p + sizeof(struct UndoEntry), text, entry -> record.len);
+	log -> len += size;
+	memcpy(log -> data + log -> len - sizeof(size_t), &size, sizeof(size_t));
+}
+
+// Moves the last entry of from onto the end of to.
+void undo_move(struct UndoLog *from, struct UndoLog *to) {
+	struct UndoEntry *entry = undo_last(from);
+	undo_push(to, entry, (char *) (entry + 1));
+	from -> len -= undo_entry_size(entry -> record.len);
+}
+
+// Adds text to the front or back of the last entry's.
+void undo_extend(struct UndoLog *log, const char *s, int len, int prepend) {
+	size_t start = (char *) undo_last(log) - log -> data;
+	struct UndoEntry *entry = (struct UndoEntry *) (log -> data + start);
+	size_t size = undo_entry_size(entry -> record.len + len);
+	undo_reserve(log, start + size);
+
+	entry = (struct UndoEntry *) (log -> data + start);
+	char *text = (char *) (entry + 1);
+	if (prepend) {
+		memmove(text + len, text, entry -> record.len);
+		memcpy(text, s, len);
+		entry -> record.at -= len;
+	} else {
+		memcpy(text + entry -> record.len, s, len);
+	}
+
+	entry -> record.len += len;
+	entry -> group = Ed.buffer -> undo.group;
+	log -> len = start + size;
+	memcpy(log -> data + log -> len - sizeof(size_t), &size, sizeof(size_t));
+}
+
+// Drops the oldest groups, down to three quarters of the cap so that the
+// move is paid for rarely.
+void undo_trim() {
+	struct UndoLog *log = &Ed.buffer -> undo.undo;
+	if (log -> len <= DAVE_ED_UNDO_BYTES) return;
+
+	size_t drop = 0;
+	while (drop < log -> len && log -> len - drop > DAVE_ED_UNDO_BYTES / 4 * 3) {
+		int group = ((struct UndoEntry *) (log -> data + drop)) -> group;
+		while (drop < log -> len && ((struct UndoEntry *) (log -> data + drop)) -> group == group)
+			drop += undo_entry_size(((struct UndoEntry *) (log -> data + drop)) -> record.len);
+	}
+
+	memmove(log -> data, log -> data + drop, log -> len - drop);
+	log -> len -= drop;
+}
+
+void editor_undo_record(int op, int row, int at, const char *s, int len) {
+	if (Ed.buffer -> undo.suspended) return;
+
+	Ed.buffer -> undo.redo.len = 0;
+
+	// Runs of characters typed or deleted on consecutive keypresses merge.
+	struct UndoEntry *last = undo_last(&Ed.buffer -> undo.undo);
+	if (last && last -> group >= Ed.buffer -> undo.group - 1 && last -> record.op == op && last -> record.row == row) {
+		if (op == EDIT_INSERT_TEXT && at == last -> record.at + last -> record.len) {
+			undo_extend(&Ed.buffer -> undo.undo, s, len, 0);
+
+			return;
+		} else if (op == EDIT_DELETE_TEXT && at == last -> record.at) {
+			undo_extend(&Ed.buffer -> undo.undo, s, len, 0);
+
+			return;
+		} else if (op == EDIT_DELETE_TEXT && at + len == last -> record.at) {
+			undo_extend(&Ed.buffer -> undo.undo, s, len, 1);
+
+			return;
+		}
+	}
+
+	struct UndoEntry entry = {{op, row, at, len}, Ed.buffer -> undo.group, Ed.buffer -> undo.cx, Ed.buffer -> undo.cy, Ed.buffer -> undo.cx, Ed.buffer -> undo.cy};
+	undo_push(&Ed.buffer -> undo.undo, &entry, s);
+	undo_trim();
+}
+
+// Called before each keypress is handled. The cursor it left behind is
+// where redoing its group puts the cursor back.
+void editor_undo_begin_group() {
+	struct UndoEntry *last = undo_last(&Ed.buffer -> undo.undo);
+	if (last && last -> group == Ed.buffer -> undo.group) {
+		last -> after_cx = Ed.view.cx;
+		last -> after_cy = Ed.view.cy;
+	}
+
+	Ed.buffer -> undo.group++;
+	Ed.buffer -> undo.cx = Ed.view.cx;
+	Ed.buffer -> undo.cy = Ed.view.cy;
+}
+
+void editor_undo_clamp_cursor() {
+	if (Ed.view.cy > Ed.buffer -> num_rows) Ed.view.cy = Ed.buffer -> num_rows;
+
+	rstore *row = editor_row(Ed.view.cy);
+	int size = row ? row -> size : 0;
+	if (Ed.view.cx > size) Ed.view.cx = size;
+}
+
+// Undoes the last group when redo is 0, or redoes the last undone one.
+void editor_undo(int redo) {
+	struct UndoLog *from = redo ? &Ed.buffer -> undo.redo : &Ed.buffer -> undo.undo;
+	struct UndoLog *to = redo ? &Ed.buffer -> undo.undo : &Ed.buffer -> undo.redo;
+	struct UndoEntry *entry = undo_last(from);
+	if (entry == NULL) {
+		editor_set_status_message(redo ? "Nothing to redo" : "Nothing to undo");
+
+		return;
+	}
+
+	int group = entry -> group;
+	Ed.buffer -> undo.suspended = 1;
+	while ((entry = undo_last(from)) && entry -> group == group) {
+		editor_apply_edit(&entry -> record, (char *) (entry + 1), !redo);
+		Ed.view.cx = redo ? entry -> after_cx : entry -> cx;
+		Ed.view.cy = redo ? entry -> after_cy : entry -> cy;
+		undo_move(from, to);
+	}
+	Ed.buffer -> undo.suspended = 0;
+
+	editor_undo_clamp_cursor();
+}
+
+// File I/O
+// Writes out iov in full, picking up where a short write left off.
+int editor_writev_all(int fd, struct iovec *iov, int count) {
+	while (count > 0) {
+		ssize_t written = writev(fd, iov, count);
+		if (written == -1) {
+			if (errno == EINTR) continue;
+
+			return -1;
+		}
+
+		while (count > 0 && (size_t) written >= iov -> iov_len) {
+			written -= iov -> iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count > 0) {
+			iov -> iov_base = (char *) iov -> iov_base + written;
+			iov -> iov_len -= written;
+		}
+	}
+
+	return 0;
+}
+
+// Streams the rows straight from the row store in batches of writev
+// calls, so no copy of the whole buffer is ever built.
+int editor_write_rows(int fd, long long *length) {
+	static char newline[] = "\n";
+	struct iovec iov[DAVE_ED_SAVE_BATCH];
+	int count = 0;
+	struct RowCursor cursor;
+	char *s;
+	int len;
+
+	*length = 0;
+	editor_rows_close_gap();
+	editor_row_cursor_seek(&cursor, 0);
+	while (editor_row_cursor_next(&cursor, &s, &len)) {
+		iov[count].iov_base = s;
+		iov[count++].iov_len = len;
+		iov[count].iov_base = newline;
+		iov[count++].iov_len = 1;
+		*length += len + 1;
+
+		if (count == DAVE_ED_SAVE_BATCH) {
+			if (editor_writev_all(fd, iov, count) == -1) return -1;
+			count = 0;
+		}
+	}
+
+	return editor_writev_all(fd, iov, count);
+}
+
+void editor_sync_directory(char *path) {
+	char *slash = strrchr(path, '/');
+	char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd != -1) {
+		fsync(fd);
+		close(fd);
+	}
+
+	free(dir);
+}
+
+// Lets go of the text a buffer was opened from, and its line index.
+void editor_buffer_free_text(struct EditorBuffer *b) {
+	if (b -> mapped) {
+		munmap(b -> map, b -> map_size);
+	} else {
+		free(b -> map);
+	}
+
+	free(b -> map_lines);
+	free(b -> map_line_state);
+	b -> map = NULL;
+	b -> map_size = 0;
+	b -> mapped = 0;
+	b -> map_lines = NULL;
+	b -> map_line_state = NULL;
+	b -> map_num_lines = 0;
+}
+
+// Files are only indexed by line; each row views the text read in or
+// mapped until it is first edited, so an open file that is only looked at
+// costs little more than its text.
+void editor_open_text(char *map, size_t size, int mapped) {
+	size_t cap = 1024;
+	size_t *lines = malloc(sizeof(size_t) * cap);
+	size_t num_lines = 0;
+	size_t offset = 0;
+
+	while (offset < size) {
+		if (num_lines == cap) {
+			cap *= 2;
+			lines = realloc(lines, sizeof(size_t) * cap);
+			if (lines == NULL) die("realloc");
+		}
+
+		lines[num_lines++] = offset;
+
+		char *newline = memchr(map + offset, '\n', size - offset);
+		offset = newline ? (size_t) (newline - map) + 1 : size;
+	}
+
+	// Small files are common, so their index is cut down to size.
+	if (num_lines < cap) {
+		size_t *fitted = realloc(lines, sizeof(size_t) * (num_lines ? num_lines : 1));
+		if (fitted) lines = fitted;
+	}
+
+	editor_buffer_free_text(Ed.buffer);
+	Ed.buffer -> map = map;
+	Ed.buffer -> map_size = size;
+	Ed.buffer -> mapped = mapped;
+	Ed.buffer -> map_lines = lines;
+	Ed.buffer -> map_num_lines = num_lines;
+	Ed.buffer -> map_line_state = calloc(num_lines ? num_lines : 1, 1);
+
+	if (num_lines > 0) {
+		Ed.buffer -> row_root = row_node_new(num_lines, 0);
+		Ed.buffer -> num_rows = num_lines;
+	}
+
+	Ed.buffer -> unsaved_changes_flag = 0;
+}
+
+void editor_open(char *file_name) {
+	free(Ed.buffer -> file_name);
+	Ed.buffer -> file_name = strdup(file_name);
+
+	editor_select_syntax_highlight();
+
+	FILE *file_pointer = fopen(file_name, "r");
+	if (!file_pointer) die("fopen");
+
+	// Large files are mapped and smaller ones read whole. Anything else,
+	// a pipe say, is read a line at a time. The stat is kept for the
+	// journal's header.
+	struct stat *st = &Ed.buffer -> journal.file_stat;
+	Ed.buffer -> journal.file_known = fstat(fileno(file_pointer), st) == 0;
+	int regular = Ed.buffer -> journal.file_known && S_ISREG(st -> st_mode);
+	if (regular && st -> st_size >= DAVE_ED_MMAP_THRESHOLD) {
+		char *map = mmap(NULL, st -> st_size, PROT_READ, MAP_PRIVATE, fileno(file_pointer), 0);
+		if (map == MAP_FAILED) die("mmap");
+
+		editor_open_text(map, st -> st_size, 1);
+		fclose(file_pointer);
+
+		return;
+	} else if (regular) {
+		char *text = malloc(st -> st_size ? st -> st_size : 1);
+		if (text == NULL) die("malloc");
+
+		size_t size = fread(text, 1, st -> st_size, file_pointer);
+		editor_open_text(text, size, 0);
+		fclose(file_pointer);
+
+		return;
+	}
+
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t line_len = 0;
+	Ed.buffer -> journal.suspended = 1;
+	Ed.buffer -> undo.suspended = 1;
+	while((line_len = getline(&line, &line_cap, file_pointer)) != -1) {
+		while (line_len > 0 && (line[line_len - 1] == '\n' ||
+								line[line_len - 1] == '\r' ))
+			line_len--;
+
+		editor_insert_row(Ed.buffer -> num_rows, line, line_len);
+	}
+
+	Ed.buffer -> journal.suspended = 0;
+	Ed.buffer -> undo.suspended = 0;
+	free(line);
+	fclose(file_pointer);
+	Ed.buffer -> unsaved_changes_flag = 0;
+}
+
+void editor_save() {
+	if (Ed.buffer -> file_name == NULL) {
+		Ed.buffer -> file_name = editor_prompt("Save as: %s (ESC to Cancel)", NULL);
+		if (Ed.buffer -> file_name == NULL) {
+			editor_set_status_message("Save Aborted");
+
+			return;
+		}
+
+		editor_select_syntax_highlight();
+	}
+
+	// The new contents go to a temporary file beside the original that is
+	// synced and renamed over it, so a crash mid-save leaves the old file
+	// whole. Mapped rows keep viewing the old file, which lives on until
+	// it is unmapped.
+	char *target = realpath(Ed.buffer -> file_name, NULL);
+	char *path = target ? target : Ed.buffer -> file_name;
+	size_t path_len = strlen(path);
+	char *temp = malloc(path_len + 8);
+	memcpy(temp, path, path_len);
+	memcpy(temp + path_len, ".XXXXXX", 8);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	long long length = 0;
+	int saved = 0;
+	int fd = mkstemp(temp);
+	if (fd != -1) {
+		struct stat st;
+		mode_t mask = umask(0);
+		umask(mask);
+		fchmod(fd, stat(path, &st) == 0 ? (st.st_mode & 07777) : (0644 & ~mask));
+
+		saved = editor_write_rows(fd, &length) == 0 && fsync(fd) == 0;
+		if (close(fd) == -1) saved = 0;
+		if (saved && rename(temp, path) == 0) {
+			editor_sync_directory(path);
+			Ed.buffer -> journal.file_known = stat(path, &Ed.buffer -> journal.file_stat) == 0;
+		} else {
+			int error = errno;
+			unlink(temp);
+			errno = error;
+			saved = 0;
+		}
+	}
+
+	free(temp);
+	free(target);
+
+	if (!saved) {
+		editor_set_status_message("Unable to Save! I/O Error: %s", strerror(errno));
+
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	Ed.buffer -> unsaved_changes_flag = 0;
+	editor_journal_discard();
+	editor_set_status_message("%lld Bytes Written to Disk (%.1f MB/s)", length, seconds > 0 ? length / seconds / 1e6 : 0.0);
+}
+
+// Buffers
+// Every open file has a buffer, and one is on screen at a time. Switching
+// commits the journal of the buffer left, drops its renders and folds the
+// rows it only looked at back into spans, so a buffer in the background
+// holds little more than its text and its edited rows.
+struct EditorBuffer *editor_buffer_new() {
+	struct EditorBuffer *b = calloc(1, sizeof(struct EditorBuffer));
+	if (b == NULL) die("calloc");
+
+	b -> journal.fd = -1;
+
+	Ed.buffers = realloc(Ed.buffers, sizeof(struct EditorBuffer *) * (Ed.num_buffers + 1));
+	if (Ed.buffers == NULL) die("realloc");
+	Ed.buffers[Ed.num_buffers++] = b;
+
+	return b;
+}
+
+int editor_buffer_index(struct EditorBuffer *b) {
+	for (int k = 0; k < Ed.num_buffers; k++)
+		if (Ed.buffers[k] == b) return k;
+
+	return -1;
+}
+
+void editor_render_cache_flush() {
+	for (int k = 0; k < Ed.render_cache_len; k++) editor_row_evict(Ed.render_cache[k]);
+	Ed.render_cache_len = 0;
+}
+
+void editor_buffer_show(struct EditorBuffer *b) {
+	if (b == Ed.buffer) return;
+
+	if (Ed.buffer) {
+		editor_journal_commit();
+		editor_render_cache_flush();
+		editor_rows_fold();
+		Ed.buffer -> view = Ed.view;
+	}
+
+	Ed.buffer = b;
+	Ed.view = b -> view;
+
+	// Lines are redrawn where they differ rather than scrolled.
+	Ed.screen_row_offset = Ed.view.row_offset;
+}
+
+void editor_buffer_free_rows(rnode *node) {
+	if (node == NULL) return;
+
+	editor_buffer_free_rows(node -> left);
+	editor_buffer_free_rows(node -> right);
+	if (node -> span == 0) editor_free_row(&node -> row);
+}
+
+// Closes the buffer on screen, without asking, and shows the one before
+// it. Closing the last buffer leaves an empty one.
+void editor_buffer_close() {
+	struct EditorBuffer *b = Ed.buffer;
+
+	editor_journal_discard();
+	editor_buffer_free_rows(b -> row_root);
+	row_node_free(b -> row_root);
+	editor_buffer_free_text(b);
+	free(b -> undo.undo.data);
+	free(b -> undo.redo.data);
+	free(b -> journal.pending);
+	free(b -> file_name);
+
+	int at = editor_buffer_index(b);
+	memmove(&Ed.buffers[at], &Ed.buffers[at + 1], sizeof(struct EditorBuffer *) * (Ed.num_buffers - at - 1));
+	Ed.num_buffers--;
+	free(b);
+
+	Ed.buffer = NULL;
+	Ed.render_cache_len = 0;
+	editor_buffer_show(Ed.num_buffers ? Ed.buffers[at > 0 ? at - 1 : 0] : editor_buffer_new());
+}
+
+// Shows the buffer step places on from the one on screen, wrapping round.
+void editor_buffer_cycle(int step) {
+	int at = editor_buffer_index(Ed.buffer);
+	editor_buffer_show(Ed.buffers[(at + step + Ed.num_buffers) % Ed.num_buffers]);
+	editor_set_status_message("[%d/%d] %s", editor_buffer_index(Ed.buffer) + 1, Ed.num_buffers, Ed.buffer -> file_name ? Ed.buffer -> file_name : "[No File Name]");
+}
+
+char *editor_base_name(char *path) {
+	char *slash = strrchr(path, '/');
+
+	return slash ? slash + 1 : path;
+}
+
+// Lists the buffers in the message bar, the one on screen in brackets.
+void editor_buffer_list() {
+	char list[sizeof(Ed.status_message)];
+	int len = 0;
+
+	for (int k = 0; k < Ed.num_buffers && len < (int) sizeof(list); k++) {
+		struct EditorBuffer *b = Ed.buffers[k];
+		char *name = b -> file_name ? editor_base_name(b -> file_name) : "[No File Name]";
+
+		len += snprintf(list + len, sizeof(list) - len, b == Ed.buffer ? "[%d:%s%s] " : "%d:%s%s ", k + 1, name, b -> unsaved_changes_flag ? "*" : "");
+	}
+
+	editor_set_status_message("%s", list);
+}
+
+int editor_unsaved_buffers() {
+	int count = 0;
+	for (int k = 0; k < Ed.num_buffers; k++)
+		if (Ed.buffers[k] -> unsaved_changes_flag) count++;
+
+	return count;
+}
+
+// Names are only resolved when their last parts agree, so opening many
+// files stays cheap.
+struct EditorBuffer *editor_buffer_find(char *file_name) {
+	char *path = realpath(file_name, NULL);
+	struct EditorBuffer *found = NULL;
+
+	for (int k = 0; k < Ed.num_buffers && found == NULL; k++) {
+		char *name = Ed.buffers[k] -> file_name;
+		if (name == NULL || strcmp(editor_base_name(name), editor_base_name(file_name))) continue;
+
+		char *other = path ? realpath(name, NULL) : NULL;
+		if (other ? !strcmp(path, other) : !strcmp(file_name, name)) found = Ed.buffers[k];
+		free(other);
+	}
+
+	free(path);
+
+	return found;
+}
+
+// Shows file_name in a buffer of its own, or in the one it is already open
+// in. An untouched empty buffer is used rather than left behind. A file
+// that does not exist yet is named, to be created on the first save.
+// Returns 0 for a buffer freshly opened, 1 when the file was already open
+// and -1 when it is there but cannot be read. Only a fresh buffer may have
+// a journal to recover.
+int editor_open_buffer(char *file_name) {
+	struct EditorBuffer *b = editor_buffer_find(file_name);
+	if (b) {
+		editor_buffer_show(b);
+
+		return 1;
+	}
+
+	int exists = access(file_name, F_OK) == 0;
+	if (exists && access(file_name, R_OK) == -1) return -1;
+
+	b = Ed.buffer;
+	if (b == NULL || b -> file_name || b -> num_rows || b -> unsaved_changes_flag) b = editor_buffer_new();
+	editor_buffer_show(b);
+
+	if (exists) {
+		editor_open(file_name);
+	} else {
+		b -> file_name = strdup(file_name);
+		editor_select_syntax_highlight();
+	}
+
+	return 0;
+}
+
+// Regex
+// Patterns are parsed into a small tree and compiled twice into Thompson
+// NFAs: once forwards, and once backwards behind a leading .*, so a single
+// backward pass over a line marks every position a match can start at.
+// The NFAs are never simulated directly. DFA states are built from them the
+// first time they are reached and cached, so matching stays linear in the
+// line however the pattern is written; nothing ever backtracks.
+// Supported are literals, ., [...] classes, the \d \w \s escapes, * + ?,
+// | and grouping, with ^ and $ matching at the start and end of the line
+// wherever they appear.
+enum RegexNodeType {
+	RE_EMPTY = 0,
+	RE_BOL,
+	RE_EOL,
+	RE_SET,
+	RE_CAT,
+	RE_ALT,
+	RE_STAR,
+	RE_PLUS,
+	RE_QUEST
+};
+
+struct RegexNode {
+	int type;
+	int set;
+	struct RegexNode *left;
+	struct RegexNode *right;
+};
+
+// RE_EDGE holds only where a scan begins at the edge of the line, and
+// RE_END only once it has read to the other edge; which of ^ and $ each
+// stands for depends on the direction a program reads in.
+enum RegexStateType {
+	RE_BYTE = 0,
+	RE_SPLIT,
+	RE_EDGE,
+	RE_END,
+	RE_MATCH
+};
+
+struct RegexState {
+	int type;
+	int set;
+	int out;
+	int out1;
+};
+
+struct RegexProg {
+	struct RegexState *states;
+	int num_states;
+	int cap;
+	int start;
+};
+
+struct Regex {
+	unsigned char (*sets)[32];
+	int num_sets;
+	unsigned char byte_class[256];
+	int num_classes;
+	int anchor_start;
+	int anchor_end;
+	struct RegexProg forward;
+	struct RegexProg reverse;
+};
+
+struct RegexParser {
+	struct Regex *regex;
+	const char *p;
+	const char *start;
+	int ignore_case;
+	struct RegexNode *nodes;
+	int num_nodes;
+	int error;
+};
+
+#define REGEX_BIT(bits, c) ((bits)[(c) >> 3] & (1 << ((c) & 7)))
+
+void regex_bits_add(unsigned char *bits, int c, int ignore_case) {
+	bits[c >> 3] |= 1 << (c & 7);
+	if (ignore_case && c >= 'a' && c <= 'z') regex_bits_add(bits, c - 32, 0);
+	if (ignore_case && c >= 'A' && c <= 'Z') regex_bits_add(bits, c + 32, 0);
+}
+
+// Fills bits with the class named by escape c, returning 0 if it names none.
+int regex_escape_class(int c, unsigned char *bits) {
+	int lower = c | 0x20;
+	if (lower != 'd' && lower != 'w' && lower != 's') return 0;
+
+	for (int b = 0; b < 256; b++) {
+		int in = lower == 'd' ? (b >= '0' && b <= '9') :
+				 lower == 'w' ? (b < 128 && (isalnum(b) || b == '_')) :
+				 (b == ' ' || b == '\t' || b == '\r' || b == '\n' || b == '\f' || b == '\v');
+		if (in != (c != lower)) bits[b >> 3] |= 1 << (b & 7);
+	}
+
+	return 1;
+}
+
+int regex_new_set(struct Regex *re) {
+	re -> sets = realloc(re -> sets, sizeof(*re -> sets) * (re -> num_sets + 1));
+	memset(re -> sets[re -> num_sets], 0, sizeof(*re -> sets));
+
+	return re -> num_sets++;
+}
+
+struct RegexNode *regex_node(struct RegexParser *parser, int type, struct RegexNode *left, struct RegexNode *right) {
+	struct RegexNode *node = &parser -> nodes[parser -> num_nodes++];
+	node -> type = type;
+	node -> set = -1;
+	node -> left = left;
+	node -> right = right;
+
+	return node;
+}
+
+void regex_parse_class(struct RegexParser *parser, unsigned char *bits) {
+	int negate = 0;
+	if (*parser -> p == '^') {
+		negate = 1;
+		parser -> p++;
+	}
+
+	// A ']' right after the opening bracket is taken literally.
+	const char *first = parser -> p;
+	while (*parser -> p && (*parser -> p != ']' || parser -> p == first)) {
+		int lo = (unsigned char) *parser -> p++;
+		if (lo == '\\' && *parser -> p) {
+			lo = (unsigned char) *parser -> p++;
+			if (regex_escape_class(lo, bits)) continue;
+		}
+
+		int hi = lo;
+		if (parser -> p[0] == '-' && parser -> p[1] && parser -> p[1] != ']') {
+			hi = (unsigned char) parser -> p[1];
+			parser -> p += 2;
+		}
+
+		for (int c = lo; c <= hi; c++) regex_bits_add(bits, c, parser -> ignore_case);
+	}
+
+	if (*parser -> p != ']') {
+		parser -> error = 1;
+
+		return;
+	}
+
+	parser -> p++;
+	if (negate)
+		for (int k = 0; k < 32; k++) bits[k] = ~bits[k];
+}
+
+struct RegexNode *regex_parse_alt(struct RegexParser *parser);
+
+struct RegexNode *regex_parse_atom(struct RegexParser *parser) {
+	int c = (unsigned char) *parser -> p++;
+
+	if (c == '(') {
+		struct RegexNode *node = regex_parse_alt(parser);
+		if (*parser -> p == ')') parser -> p++;
+		else parser -> error = 1;
+
+		return node;
+	} else if (c == '^') {
+		return regex_node(parser, RE_BOL, NULL, NULL);
+	} else if (c == '$') {
+		return regex_node(parser, RE_EOL, NULL, NULL);
+	}
+
+	struct RegexNode *node = regex_node(parser, RE_SET, NULL, NULL);
+	node -> set = regex_new_set(parser -> regex);
+	unsigned char *bits = parser -> regex -> sets[node -> set];
+
+	if (c == '.') {
+		memset(bits, 0xff, 32);
+	} else if (c == '[') {
+		regex_parse_class(parser, bits);
+	} else if (c == '\\') {
+		c = (unsigned char) *parser -> p;
+		if (c == '\0') {
+			parser -> error = 1;
+		} else {
+			parser -> p++;
+			if (!regex_escape_class(c, bits)) regex_bits_add(bits, c == 't' ? '\t' : c, parser -> ignore_case);
+		}
+	} else {
+		regex_bits_add(bits, c, parser -> ignore_case);
+	}
+
+	return node;
+}
+
+struct RegexNode *regex_parse_repeat(struct RegexParser *parser) {
+	struct RegexNode *node = regex_parse_atom(parser);
+
+	while (*parser -> p == '*' || *parser -> p == '+' || *parser -> p == '?') {
+		int type = *parser -> p == '*' ? RE_STAR : (*parser -> p == '+' ? RE_PLUS : RE_QUEST);
+		node = regex_node(parser, type, node, NULL);
+		parser -> p++;
+	}
+
+	return node;
+}
+
+struct RegexNode *regex_parse_cat(struct RegexParser *parser) {
+	struct RegexNode *node = NULL;
+
+	while (*parser -> p && *parser -> p != '|' && *parser -> p != ')' && !parser -> error) {
+		struct RegexNode *next = regex_parse_repeat(parser);
+		node = node ? regex_node(parser, RE_CAT, node, next) : next;
+	}
+
+	return node ? node : regex_node(parser, RE_EMPTY, NULL, NULL);
+}
+
+struct RegexNode *regex_parse_alt(struct RegexParser *parser) {
+	struct RegexNode *node = regex_parse_cat(parser);
+
+	while (*parser -> p == '|' && !parser -> error) {
+		parser -> p++;
+		node = regex_node(parser, RE_ALT, node, regex_parse_cat(parser));
+	}
+
+	return node;
+}
+
+int regex_add_state(struct RegexProg *prog, int type, int set, int out, int out1) {
+	if (prog -> num_states == prog -> cap) {
+		prog -> cap = prog -> cap ? prog -> cap * 2 : 16;
+		prog -> states = realloc(prog -> states, sizeof(struct RegexState) * prog -> cap);
+	}
+
+	struct RegexState *state = &prog -> states[prog -> num_states];
+	state -> type = type;
+	state -> set = set;
+	state -> out = out;
+	state -> out1 = out1;
+
+	return prog -> num_states++;
+}
+
+// Compiles node to carry on into state next, reading the text backwards
+// when reverse is set. Returns the state the node starts at.
+int regex_compile_node(struct RegexProg *prog, struct RegexNode *node, int next, int reverse) {
+	int split, body;
+
+	switch (node -> type) {
+		case RE_SET:
+			return regex_add_state(prog, RE_BYTE, node -> set, next, -1);
+		case RE_BOL:
+			return regex_add_state(prog, reverse ? RE_END : RE_EDGE, -1, next, -1);
+		case RE_EOL:
+			return regex_add_state(prog, reverse ? RE_EDGE : RE_END, -1, next, -1);
+		case RE_CAT:
+			if (reverse) return regex_compile_node(prog, node -> right, regex_compile_node(prog, node -> left, next, reverse), reverse);
+
+			return regex_compile_node(prog, node -> left, regex_compile_node(prog, node -> right, next, reverse), reverse);
+		case RE_ALT:
+			body = regex_compile_node(prog, node -> left, next, reverse);
+
+			return regex_add_state(prog, RE_SPLIT, -1, body, regex_compile_node(prog, node -> right, next, reverse));
+		case RE_QUEST:
+			return regex_add_state(prog, RE_SPLIT, -1, regex_compile_node(prog, node -> left, next, reverse), next);
+		case RE_STAR:
+		case RE_PLUS:
+			split = regex_add_state(prog, RE_SPLIT, -1, -1, next);
+			body = regex_compile_node(prog, node -> left, split, reverse);
+			prog -> states[split].out = body;
+
+			return node -> type == RE_STAR ? split : body;
+	}
+
+	return next;
+}
+
+// any, when not -1, is a set of every byte looped over ahead of the pattern
+// so that it may match anywhere rather than only where the scan begins.
+void regex_compile_prog(struct RegexProg *prog, struct RegexNode *root, int reverse, int any) {
+	int match = regex_add_state(prog, RE_MATCH, -1, -1, -1);
+	prog -> start = regex_compile_node(prog, root, match, reverse);
+
+	if (any != -1) {
+		int loop = regex_add_state(prog, RE_SPLIT, -1, -1, prog -> start);
+		prog -> states[loop].out = regex_add_state(prog, RE_BYTE, any, loop, -1);
+		prog -> start = loop;
+	}
+}
+
+// Bytes that every set treats alike share a class, which keeps the DFA
+// transition tables narrow.
+void regex_byte_classes(struct Regex *re) {
+	int remap[512];
+	memset(re -> byte_class, 0, sizeof(re -> byte_class));
+	re -> num_classes = 1;
+
+	for (int s = 0; s < re -> num_sets; s++) {
+		int n = 0;
+		memset(remap, -1, sizeof(int) * re -> num_classes * 2);
+		for (int c = 0; c < 256; c++) {
+			int key = re -> byte_class[c] * 2 + !!REGEX_BIT(re -> sets[s], c);
+			if (remap[key] == -1) remap[key] = n++;
+			re -> byte_class[c] = remap[key];
+		}
+
+		re -> num_classes = n;
+	}
+}
+
+void regex_free(struct Regex *re) {
+	if (re == NULL) return;
+
+	free(re -> sets);
+	free(re -> forward.states);
+	free(re -> reverse.states);
+	free(re);
+}
+
+// Whether every way through node begins, or ends, with the anchor type.
+int regex_anchored(struct RegexNode *node, int type) {
+	if (node -> type == RE_CAT) return regex_anchored(type == RE_BOL ? node -> left : node -> right, type);
+	if (node -> type == RE_ALT) return regex_anchored(node -> left, type) && regex_anchored(node -> right, type);
+
+	return node -> type == type;
+}
+
+// Returns NULL when the pattern does not parse.
+struct Regex *regex_compile(const char *pattern, int ignore_case) {
+	struct Regex *re = calloc(1, sizeof(struct Regex));
+	struct RegexParser parser = {re, pattern, pattern, ignore_case, NULL, 0, 0};
+	parser.nodes = malloc(sizeof(struct RegexNode) * (3 * strlen(pattern) + 4));
+
+	struct RegexNode *root = regex_parse_alt(&parser);
+	if (*parser.p != '\0') parser.error = 1;
+
+	if (!parser.error) {
+		re -> anchor_start = regex_anchored(root, RE_BOL);
+		re -> anchor_end = regex_anchored(root, RE_EOL);
+		int any = regex_new_set(re);
+		memset(re -> sets[any], 0xff, 32);
+		regex_compile_prog(&re -> forward, root, 0, -1);
+		regex_compile_prog(&re -> reverse, root, 1, re -> anchor_end ? -1 : any);
+		regex_byte_classes(re);
+	}
+
+	free(parser.nodes);
+	if (parser.error) {
+		regex_free(re);
+
+		return NULL;
+	}
+
+	return re;
+}
+
+// A lazily built DFA over one of the programs. Each state is the set of NFA
+// states it stands for; transitions are worked out on first use and cached
+// per byte class. State 0 is the dead state; a scan begins at start, or at
+// edge_start when it begins at the edge of the line.
+// REGEX_ACCEPT_END marks states that accept once the other edge is reached.
+#define REGEX_ACCEPT 1
+#define REGEX_DEAD 2
+#define REGEX_ACCEPT_END 4
+
+struct RegexDFA {
+	struct Regex *regex;
+	struct RegexProg *prog;
+	int num_states;
+	int start;
+	int edge_start;
+	int num_kept;
+	int flushes;
+	int *trans;
+	unsigned char *flags;
+	int *set_start;
+	int *set_len;
+	int *pool;
+	int pool_len;
+	int pool_cap;
+	int *table;
+	int *stack;
+	int *work;
+	unsigned int *marks;
+	unsigned int mark;
+};
+
+#define REGEX_TABLE_SIZE (2 * DAVE_ED_REGEX_DFA_STATES)
+
+// Adds state s and everything reachable from it without reading a byte,
+// passing RE_EDGE states only when edge is set. RE_END states are kept
+// for the end of the scan to settle.
+void regex_closure(struct RegexDFA *dfa, int s, int edge, int *n) {
+	int sp = 0;
+	dfa -> stack[sp++] = s;
+
+	while (sp) {
+		s = dfa -> stack[--sp];
+		if (s < 0 || dfa -> marks[s] == dfa -> mark) continue;
+
+		dfa -> marks[s] = dfa -> mark;
+		struct RegexState *state = &dfa -> prog -> states[s];
+		if (state -> type == RE_SPLIT) {
+			dfa -> stack[sp++] = state -> out1;
+			dfa -> stack[sp++] = state -> out;
+		} else if (state -> type == RE_EDGE) {
+			if (edge) dfa -> stack[sp++] = state -> out;
+		} else {
+			dfa -> work[(*n)++] = s;
+		}
+	}
+}
+
+void regex_dfa_next_mark(struct RegexDFA *dfa) {
+	if (++dfa -> mark == 0) {
+		memset(dfa -> marks, 0, sizeof(unsigned int) * dfa -> prog -> num_states);
+		dfa -> mark = 1;
+	}
+}
+
+// Returns the table slot holding the state for set, or the empty slot
+// where it belongs.
+int *regex_dfa_slot(struct RegexDFA *dfa, int *set, int n) {
+	unsigned int hash = 2166136261u;
+	for (int k = 0; k < n; k++) hash = (hash ^ set[k]) * 16777619u;
+
+	for (unsigned int i = hash & (REGEX_TABLE_SIZE - 1); ; i = (i + 1) & (REGEX_TABLE_SIZE - 1)) {
+		int state = dfa -> table[i] - 1;
+		if (state == -1) return &dfa -> table[i];
+		if (dfa -> set_len[state] == n && !memcmp(&dfa -> pool[dfa -> set_start[state]], set, sizeof(int) * n)) return &dfa -> table[i];
+	}
+}
+
+// Drops every state but the dead and start states once the cache is full,
+// so a pattern whose DFA blows up only costs time, never memory.
+void regex_dfa_flush(struct RegexDFA *dfa) {
+	int last = dfa -> num_kept - 1;
+	dfa -> num_states = dfa -> num_kept;
+	dfa -> pool_len = dfa -> set_start[last] + dfa -> set_len[last];
+	dfa -> flushes++;
+	memset(dfa -> table, 0, sizeof(int) * REGEX_TABLE_SIZE);
+
+	for (int state = 0; state < dfa -> num_kept; state++) {
+		*regex_dfa_slot(dfa, &dfa -> pool[dfa -> set_start[state]], dfa -> set_len[state]) = state + 1;
+		memset(&dfa -> trans[state * dfa -> regex -> num_classes], -1, sizeof(int) * dfa -> regex -> num_classes);
+	}
+}
+
+// Whether set reaches a match through RE_END states alone.
+int regex_accepts_at_end(struct RegexDFA *dfa, int *set, int n) {
+	int sp = 0;
+	regex_dfa_next_mark(dfa);
+	for (int k = 0; k < n; k++)
+		if (dfa -> prog -> states[set[k]].type == RE_END) dfa -> stack[sp++] = dfa -> prog -> states[set[k]].out;
+
+	while (sp) {
+		int s = dfa -> stack[--sp];
+		if (dfa -> marks[s] == dfa -> mark) continue;
+
+		dfa -> marks[s] = dfa -> mark;
+		struct RegexState *state = &dfa -> prog -> states[s];
+		if (state -> type == RE_MATCH) return 1;
+
+		if (state -> type == RE_SPLIT) {
+			dfa -> stack[sp++] = state -> out1;
+			dfa -> stack[sp++] = state -> out;
+		} else if (state -> type == RE_END) {
+			dfa -> stack[sp++] = state -> out;
+		}
+	}
+
+	return 0;
+}
+
+int regex_dfa_intern(struct RegexDFA *dfa, int *set, int n) {
+	for (int i = 1; i < n; i++) {
+		int s = set[i], j = i;
+		for (; j > 0 && set[j - 1] > s; j--) set[j] = set[j - 1];
+		set[j] = s;
+	}
+
+	int *slot = regex_dfa_slot(dfa, set, n);
+	if (*slot) return *slot - 1;
+
+	if (dfa -> num_states == DAVE_ED_REGEX_DFA_STATES) {
+		regex_dfa_flush(dfa);
+		slot = regex_dfa_slot(dfa, set, n);
+		if (*slot) return *slot - 1;
+	}
+
+	if (dfa -> pool_len + n > dfa -> pool_cap) {
+		while (dfa -> pool_len + n > dfa -> pool_cap) dfa -> pool_cap = dfa -> pool_cap ? dfa -> pool_cap * 2 : 256;
+		dfa -> pool = realloc(dfa -> pool, sizeof(int) * dfa -> pool_cap);
+	}
+
+	int state = dfa -> num_states++;
+	memcpy(&dfa -> pool[dfa -> pool_len], set, sizeof(int) * n);
+	dfa -> set_start[state] = dfa -> pool_len;
+	dfa -> set_len[state] = n;
+	dfa -> pool_len += n;
+	memset(&dfa -> trans[state * dfa -> regex -> num_classes], -1, sizeof(int) * dfa -> regex -> num_classes);
+
+	dfa -> flags[state] = n == 0 ? REGEX_DEAD : 0;
+	for (int k = 0; k < n; k++)
+		if (dfa -> prog -> states[set[k]].type == RE_MATCH) dfa -> flags[state] |= REGEX_ACCEPT;
+	if (regex_accepts_at_end(dfa, set, n)) dfa -> flags[state] |= REGEX_ACCEPT_END;
+
+	*slot = state + 1;
+
+	return state;
+}
+
+int regex_dfa_step(struct RegexDFA *dfa, int state, int c) {
+	int *next = &dfa -> trans[state * dfa -> regex -> num_classes + dfa -> regex -> byte_class[c]];
+	if (*next >= 0) return *next;
+
+	int n = 0;
+	int *set = &dfa -> pool[dfa -> set_start[state]];
+	regex_dfa_next_mark(dfa);
+	for (int k = 0; k < dfa -> set_len[state]; k++) {
+		struct RegexState *s = &dfa -> prog -> states[set[k]];
+		if (s -> type == RE_BYTE && REGEX_BIT(dfa -> regex -> sets[s -> set], c)) regex_closure(dfa, s -> out, 0, &n);
+	}
+
+	int flushes = dfa -> flushes;
+	int target = regex_dfa_intern(dfa, dfa -> work, n);
+
+	// A flush may have handed the old state's number to another set.
+	if (dfa -> flushes == flushes) *next = target;
+
+	return target;
+}
+
+void regex_dfa_init(struct RegexDFA *dfa, struct Regex *re, struct RegexProg *prog) {
+	memset(dfa, 0, sizeof(struct RegexDFA));
+	dfa -> regex = re;
+	dfa -> prog = prog;
+	dfa -> trans = malloc(sizeof(int) * DAVE_ED_REGEX_DFA_STATES * re -> num_classes);
+	dfa -> flags = malloc(DAVE_ED_REGEX_DFA_STATES);
+	dfa -> set_start = malloc(sizeof(int) * DAVE_ED_REGEX_DFA_STATES);
+	dfa -> set_len = malloc(sizeof(int) * DAVE_ED_REGEX_DFA_STATES);
+	dfa -> table = calloc(REGEX_TABLE_SIZE, sizeof(int));
+	dfa -> stack = malloc(sizeof(int) * (3 * prog -> num_states + 1));
+	dfa -> work = malloc(sizeof(int) * prog -> num_states);
+	dfa -> marks = calloc(prog -> num_states, sizeof(unsigned int));
+
+	dfa -> num_kept = DAVE_ED_REGEX_DFA_STATES;
+	regex_dfa_intern(dfa, dfa -> work, 0);
+	for (int edge = 0; edge < 2; edge++) {
+		int n = 0;
+		regex_dfa_next_mark(dfa);
+		regex_closure(dfa, prog -> start, edge, &n);
+		*(edge ? &dfa -> edge_start : &dfa -> start) = regex_dfa_intern(dfa, dfa -> work, n);
+	}
+
+	dfa -> num_kept = dfa -> num_states;
+}
+
+void regex_dfa_free(struct RegexDFA *dfa) {
+	free(dfa -> trans);
+	free(dfa -> flags);
+	free(dfa -> set_start);
+	free(dfa -> set_len);
+	free(dfa -> pool);
+	free(dfa -> table);
+	free(dfa -> stack);
+	free(dfa -> work);
+	free(dfa -> marks);
+}
+
+// The DFAs are built as they are used, so every thread matching a pattern
+// keeps a RegexSearch of its own.
+struct RegexSearch {
+	struct Regex *regex;
+	struct RegexDFA forward;
+	struct RegexDFA reverse;
+	unsigned char *starts;
+	int starts_cap;
+};
+
+void regex_search_init(struct RegexSearch *search, struct Regex *re) {
+	search -> regex = re;
+	regex_dfa_init(&search -> forward, re, &re -> forward);
+	regex_dfa_init(&search -> reverse, re, &re -> reverse);
+	search -> starts = NULL;
+	search -> starts_cap = 0;
+}
+
+void regex_search_free(struct RegexSearch *search) {
+	regex_dfa_free(&search -> forward);
+	regex_dfa_free(&search -> reverse);
+	free(search -> starts);
+}
+
+// Runs the reversed pattern backwards over the line, setting starts[i] to 1
+// wherever a match begins. Returns 0 when there is none anywhere.
+int regex_find_starts(struct RegexSearch *search, const char *s, int len) {
+	if (len + 1 > search -> starts_cap) {
+		search -> starts_cap = len + 1 > 2 * search -> starts_cap ? len + 1 : 2 * search -> starts_cap;
+		search -> starts = realloc(search -> starts, search -> starts_cap);
+	}
+
+	// Only the line start is a candidate, which the forward pass settles.
+	if (search -> regex -> anchor_start) {
+		memset(search -> starts, 0, len + 1);
+		search -> starts[0] = 1;
+
+		return 1;
+	}
+
+	// The scan begins at the line end, and a ^ holds only once it is at 0.
+	struct RegexDFA *dfa = &search -> reverse;
+	int state = dfa -> edge_start;
+	int found = search -> starts[len] = !!(dfa -> flags[state] & (len ? REGEX_ACCEPT : REGEX_ACCEPT | REGEX_ACCEPT_END));
+
+	for (int i = len - 1; i >= 0; i--) {
+		state = regex_dfa_step(dfa, state, (unsigned char) s[i]);
+		if (dfa -> flags[state] & REGEX_DEAD) {
+			memset(search -> starts, 0, i + 1);
+			break;
+		}
+
+		search -> starts[i] = !!(dfa -> flags[state] & (i ? REGEX_ACCEPT : REGEX_ACCEPT | REGEX_ACCEPT_END));
+		found |= search -> starts[i];
 	}
 
-	Ed.cy++;
-	Ed.cx = 0;
+	return found;
 }
 
-void editor_delete_character() {
-	if (Ed.cy == Ed.num_rows) return;
-	if (Ed.cx == 0 && Ed.cy == 0) return;
+// Returns the end of a match starting at at, or -1 when none does. The
+// match runs to the end of the first stretch of accepting states, so the
+// scan stops soon after it is known rather than going on for a longer
+// match, which kept long lines quadratic.
+int regex_match_end(struct RegexSearch *search, const char *s, int len, int at) {
+	struct RegexDFA *dfa = &search -> forward;
+	int state = at == 0 ? dfa -> edge_start : dfa -> start;
+	int end = -1;
+
+	for (int i = at; ; i++) {
+		if (dfa -> flags[state] & (i == len ? REGEX_ACCEPT | REGEX_ACCEPT_END : REGEX_ACCEPT)) end = i;
+		else if (end != -1) break;
+		if (i == len) break;
+
+		state = regex_dfa_step(dfa, state, (unsigned char) s[i]);
+		if (dfa -> flags[state] & REGEX_DEAD) break;
+	}
+
+	return end;
+}
+
+// Search
+// Queries are matched against the raw chars of each row. Candidate positions
+// are found 16 at a time by comparing both the first and the last byte of
+// the needle, and only those are verified byte by byte.
+// In regex mode the pattern is compiled instead and matched line by line.
+struct SearchQuery {
+	char *needle;
+	int len;
+	int ignore_case;
+	struct Regex *regex;
+};
+
+#define FOLD(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + 32 : (c))
+
+int search_verify(const char *text, struct SearchQuery *query) {
+	if (!query -> ignore_case) return !memcmp(text, query -> needle, query -> len);
+
+	for (int k = 0; k < query -> len; k++)
+		if (FOLD((unsigned char) text[k]) != (unsigned char) query -> needle[k]) return 0;
+
+	return 1;
+}
+
+// Returns the offset of the first match in text, or -1 when there is none.
+int editor_search_text(struct SearchQuery *query, const char *text, int len) {
+	int n = query -> len;
+	if (n == 0) return 0;
+	if (n > len) return -1;
+
+	int i = 0;
+#ifdef __SSE2__
+	unsigned char first = query -> needle[0];
+	unsigned char last = query -> needle[n - 1];
+	unsigned char first_alt = first, last_alt = last;
+	if (query -> ignore_case) {
+		first_alt = toupper(first);
+		last_alt = toupper(last);
+	}
+
+	__m128i first_lo = _mm_set1_epi8(first), first_hi = _mm_set1_epi8(first_alt);
+	__m128i last_lo = _mm_set1_epi8(last), last_hi = _mm_set1_epi8(last_alt);
+
+	for (; i + n - 1 + 16 <= len; i += 16) {
+		__m128i block_first = _mm_loadu_si128((const __m128i *) (text + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i *) (text + i + n - 1));
+		__m128i eq_first = _mm_or_si128(_mm_cmpeq_epi8(block_first, first_lo), _mm_cmpeq_epi8(block_first, first_hi));
+		__m128i eq_last = _mm_or_si128(_mm_cmpeq_epi8(block_last, last_lo), _mm_cmpeq_epi8(block_last, last_hi));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(eq_first, eq_last));
+
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+			if (search_verify(text + i + bit, query)) return i + bit;
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	if (!query -> ignore_case) {
+		char *match = memmem(text + i, len - i, query -> needle, n);
+
+		return match ? match - text : -1;
+	}
+
+	for (; i + n <= len; i++)
+		if (search_verify(text + i, query)) return i;
+
+	return -1;
+}
+
+// Returns -1 when a regex does not compile.
+int editor_search_query_init(struct SearchQuery *query, char *s, int ignore_case, int regex) {
+	query -> len = strlen(s);
+	query -> ignore_case = ignore_case;
+	query -> needle = malloc(query -> len + 1);
+	for (int k = 0; k <= query -> len; k++)
+		query -> needle[k] = ignore_case ? FOLD((unsigned char) s[k]) : s[k];
+
+	query -> regex = regex ? regex_compile(s, ignore_case) : NULL;
+
+	return regex && query -> regex == NULL ? -1 : 0;
+}
+
+void editor_search_query_free(struct SearchQuery *query) {
+	free(query -> needle);
+	regex_free(query -> regex);
+}
+
+// Returns the start of the first match in s at or after col, setting
+// *match_len, or -1 when there is none. A regex needs the starts of the
+// line worked out first.
+int editor_search_next(struct SearchQuery *query, struct RegexSearch *regex, const char *s, int len, int col, int *match_len) {
+	if (regex) {
+		// An empty match is passed over for one further on. It only counts
+		// when the whole line has nothing longer, and then once, so ^ and $
+		// find lines while x* does not match at every position.
+		unsigned char *start;
+		int from = col, empty = -1;
+		while (col <= len && (start = memchr(regex -> starts + col, 1, len + 1 - col))) {
+			col = start - regex -> starts;
+			int end = regex_match_end(regex, s, len, col);
+			if (end > col) {
+				*match_len = end - col;
+
+				return col;
+			}
+
+			if (end == col && empty == -1) empty = col;
+			col++;
+		}
+
+		if (empty != -1 && from == 0) {
+			*match_len = 0;
+
+			return empty;
+		}
+
+		return -1;
+	}
+
+	int match = editor_search_text(query, s + col, len - col);
+	if (match == -1) return -1;
+
+	*match_len = query -> len;
 
-	rstore *row = &Ed.row[Ed.cy];
-	if (Ed.cx > 0) {
-		editor_row_delete_character(row, Ed.cx - 1);
-		Ed.cx--;
+	return col + match;
+}
+
+// Reads a row's chars without loading it out of a mapped span.
+void editor_row_text(int at, char **s, int *len) {
+	int offset = 0;
+	rnode *node = row_node_find(at, &offset);
+
+	if (node -> span) {
+		editor_map_line(node -> map_line + offset, s, len);
 	} else {
-		Ed.cx = Ed.row[Ed.cy - 1].size;
-		editor_row_append_string(&Ed.row[Ed.cy - 1], row -> chars, row -> size);
-		editor_delete_row(Ed.cy);
-		Ed.cy--;
+		*s = node -> row.chars;
+		*len = node -> row.size;
 	}
 }
 
-// File I/O
-char *editor_rows_to_string(int *bufferlen) {
-	int totlen = 0;
-	int j = -1;
+// Whole-buffer searches run on a pool of worker threads. The rows are cut
+// into chunks, each worker claims chunks until none are left, and the
+// per-chunk matches are joined in order into a sorted match index that
+// next/previous navigation walks. A new query cancels the running job.
+struct SearchMatch {
+	int row;
+	int col;
+	int len;
+};
+
+struct SearchJob {
+	struct SearchQuery query;
+	int num_chunks;
+	int next_chunk;
+	int chunks_done;
+	int cancelled;
+	struct SearchMatch **chunk_matches;
+	int *chunk_counts;
+	unsigned char *chunk_done;
+	pthread_t *threads;
+	int num_threads;
+};
+
+void editor_search_chunk(struct SearchJob *job, struct RegexSearch *regex, int chunk) {
+	int start = chunk * DAVE_ED_SEARCH_CHUNK_ROWS;
+	int end = start + DAVE_ED_SEARCH_CHUNK_ROWS;
+	if (end > Ed.buffer -> num_rows) end = Ed.buffer -> num_rows;
+
+	struct SearchMatch *matches = NULL;
+	int count = 0, cap = 0;
+	struct RowCursor cursor;
+	char *s;
+	int len;
+
+	// Spans loaded meanwhile reshape the tree but keep row numbers, so the
+	// cursor seeks again after each batch.
+	pthread_rwlock_rdlock(&rows_lock);
+	editor_row_cursor_seek(&cursor, start);
+	for (int at = start; at < end && editor_row_cursor_next(&cursor, &s, &len); at++) {
+		if ((at - start + 1) % DAVE_ED_SEARCH_BATCH_ROWS == 0) {
+			pthread_rwlock_unlock(&rows_lock);
+			pthread_rwlock_rdlock(&rows_lock);
+			editor_row_cursor_seek(&cursor, at);
+			if (!editor_row_cursor_next(&cursor, &s, &len)) break;
+		}
+
+		if (regex && !regex_find_starts(regex, s, len)) continue;
+
+		int col = 0;
+		int match, match_len;
+		while (col <= len && (match = editor_search_next(&job -> query, regex, s, len, col, &match_len)) != -1) {
+			if (count == cap) {
+				cap = cap ? cap * 2 : 64;
+				matches = realloc(matches, sizeof(struct SearchMatch) * cap);
+			}
+
+			matches[count].row = at;
+			matches[count].col = match;
+			matches[count].len = match_len;
+			count++;
+			col = match + (match_len ? match_len : 1);
+		}
+	}
+	pthread_rwlock_unlock(&rows_lock);
+
+	job -> chunk_matches[chunk] = matches;
+	job -> chunk_counts[chunk] = count;
+	__atomic_store_n(&job -> chunk_done[chunk], 1, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&job -> chunks_done, 1, __ATOMIC_RELEASE);
+	editor_wake('s');
+}
+
+void *editor_search_worker(void *arg) {
+	struct SearchJob *job = arg;
+	struct RegexSearch search, *regex = NULL;
+	if (job -> query.regex) {
+		regex_search_init(&search, job -> query.regex);
+		regex = &search;
+	}
+
+	while (!__atomic_load_n(&job -> cancelled, __ATOMIC_ACQUIRE)) {
+		int chunk = __atomic_fetch_add(&job -> next_chunk, 1, __ATOMIC_ACQ_REL);
+		if (chunk >= job -> num_chunks) break;
+
+		editor_search_chunk(job, regex, chunk);
+	}
+
+	if (regex) regex_search_free(regex);
+
+	return NULL;
+}
+
+// Returns NULL when the query is a regex that does not compile.
+struct SearchJob *editor_search_start(char *s, int ignore_case, int regex) {
+	struct SearchJob *job = calloc(1, sizeof(struct SearchJob));
+	if (editor_search_query_init(&job -> query, s, ignore_case, regex) == -1) {
+		editor_search_query_free(&job -> query);
+		free(job);
+
+		return NULL;
+	}
+
+	job -> num_chunks = (Ed.buffer -> num_rows + DAVE_ED_SEARCH_CHUNK_ROWS - 1) / DAVE_ED_SEARCH_CHUNK_ROWS;
+	job -> chunk_matches = calloc(job -> num_chunks + 1, sizeof(struct SearchMatch *));
+	job -> chunk_counts = calloc(job -> num_chunks + 1, sizeof(int));
+	job -> chunk_done = calloc(job -> num_chunks + 1, 1);
+
+	// Workers read rows as they are, so none may have its gap open.
+	editor_rows_close_gap();
+
+	// Small buffers are searched right away; threads only pay off once
+	// there are several chunks to share out.
+	if (job -> num_chunks < 2) {
+		editor_search_worker(job);
+
+		return job;
+	}
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	job -> num_threads = cpus < 1 ? 1 : (cpus > DAVE_ED_SEARCH_THREADS ? DAVE_ED_SEARCH_THREADS : cpus);
+	if (job -> num_threads > job -> num_chunks) job -> num_threads = job -> num_chunks;
+	job -> threads = malloc(sizeof(pthread_t) * job -> num_threads);
+
+	for (int t = 0; t < job -> num_threads; t++) {
+		if (pthread_create(&job -> threads[t], NULL, editor_search_worker, job) != 0) {
+			job -> num_threads = t;
+			break;
+		}
+	}
+
+	// Whatever could not get a thread is searched here.
+	if (job -> num_threads == 0) editor_search_worker(job);
+
+	return job;
+}
+
+void editor_search_free(struct SearchJob *job) {
+	if (job == NULL) return;
+
+	__atomic_store_n(&job -> cancelled, 1, __ATOMIC_RELEASE);
+	for (int t = 0; t < job -> num_threads; t++) pthread_join(job -> threads[t], NULL);
+
+	for (int k = 0; k < job -> num_chunks; k++) free(job -> chunk_matches[k]);
+	free(job -> chunk_matches);
+	free(job -> chunk_counts);
+	free(job -> chunk_done);
+	free(job -> threads);
+	editor_search_query_free(&job -> query);
+	free(job);
+}
+
+int editor_search_finished(struct SearchJob *job) {
+	return __atomic_load_n(&job -> chunks_done, __ATOMIC_ACQUIRE) == job -> num_chunks;
+}
+
+// Find
+struct {
+	int active;
+	int ignore_case;
+	int regex;
+	int bad_pattern;
+	char prompt[128];
+	struct SearchJob *job;
+	struct SearchMatch *matches;
+	int num_matches;
+	int current;
+	int indexed;
+	int scanned_chunks;
+	int highlighted_line;
+	char *saved_highlight;
+} Find;
+
+void editor_find_set_prompt() {
+	snprintf(Find.prompt, sizeof(Find.prompt), "%s%s: %%s (ESC Cancel/Arrows/Enter Confirm/Ctrl-E Case/Ctrl-R Regex)",
+			 Find.regex ? "Regex" : "Search", Find.ignore_case ? " (Ignore Case)" : "");
+}
+
+void editor_find_restore_highlight() {
+	if (Find.saved_highlight) {
+		rstore *row = editor_row(Find.highlighted_line);
+		if (row && row -> highlight) memcpy(row -> highlight, Find.saved_highlight, row -> rsize);
+		free(Find.saved_highlight);
+		Find.saved_highlight = NULL;
+	}
+}
+
+void editor_find_goto(struct SearchMatch *match) {
+	editor_find_restore_highlight();
+
+	rstore *row = editor_row(match -> row);
+	Ed.view.cy = match -> row;
+	Ed.view.cx = match -> col;
+	Ed.view.row_offset = Ed.buffer -> num_rows;
+
+	editor_syntax_settle(match -> row + 1);
+	editor_row_prepare(row);
+
+	// Chunked rows are drawn from their chunks, so only the cursor marks a
+	// match there.
+	if (row -> chunks) return;
+
+	int match_start = editor_row_cx_to_ro(row, match -> col);
+	int match_end = editor_row_cx_to_ro(row, match -> col + match -> len);
+	Find.highlighted_line = match -> row;
+	Find.saved_highlight = malloc(row -> rsize);
+	memcpy(Find.saved_highlight, row -> highlight, row -> rsize);
+	memset(&row -> highlight[match_start], HL_MATCH, match_end - match_start);
+}
+
+void editor_find_reset() {
+	editor_find_restore_highlight();
+	editor_search_free(Find.job);
+	free(Find.matches);
+	Find.job = NULL;
+	Find.matches = NULL;
+	Find.num_matches = 0;
+	Find.current = -1;
+	Find.indexed = 0;
+	Find.scanned_chunks = 0;
+}
+
+// Picks up finished chunks. The first match is shown as soon as every chunk
+// before it is done, and the index is built once all of them are.
+// Returns 1 when the screen needs redrawing.
+int editor_find_poll() {
+	struct SearchJob *job = Find.job;
+	if (job == NULL || Find.indexed) return 0;
+
+	int redraw = 0;
+	while (Find.scanned_chunks < job -> num_chunks && __atomic_load_n(&job -> chunk_done[Find.scanned_chunks], __ATOMIC_ACQUIRE)) {
+		if (Find.current == -1 && job -> chunk_counts[Find.scanned_chunks]) {
+			Find.current = 0;
+			editor_find_goto(&job -> chunk_matches[Find.scanned_chunks][0]);
+			redraw = 1;
+		}
+
+		Find.scanned_chunks++;
+	}
+
+	if (!editor_search_finished(job)) return redraw;
+
+	Find.num_matches = 0;
+	for (int k = 0; k < job -> num_chunks; k++) Find.num_matches += job -> chunk_counts[k];
+
+	Find.matches = malloc(sizeof(struct SearchMatch) * (Find.num_matches ? Find.num_matches : 1));
+	struct SearchMatch *p = Find.matches;
+	for (int k = 0; k < job -> num_chunks; k++) {
+		memcpy(p, job -> chunk_matches[k], sizeof(struct SearchMatch) * job -> chunk_counts[k]);
+		p += job -> chunk_counts[k];
+	}
+
+	Find.indexed = 1;
+
+	return 1;
+}
+
+void editor_find_callback(char *query, int key) {
+	if (key == '\r' || key == '\x1b') {
+		editor_find_reset();
+		Find.active = 0;
+
+		return;
+	} else if (key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP) {
+		int direction = (key == ARROW_RIGHT || key == ARROW_DOWN) ? 1 : -1;
+		if (!Find.indexed || Find.num_matches == 0) return;
+
+		Find.current += direction;
+		if (Find.current < 0) Find.current = Find.num_matches - 1;
+		else if (Find.current >= Find.num_matches) Find.current = 0;
+		editor_find_goto(&Find.matches[Find.current]);
+
+		return;
+	} else if (key == CTRL_KEY('e')) {
+		Find.ignore_case = !Find.ignore_case;
+		editor_find_set_prompt();
+	} else if (key == CTRL_KEY('r')) {
+		Find.regex = !Find.regex;
+		editor_find_set_prompt();
+	}
+
+	editor_find_reset();
+	Find.active = 1;
+	Find.bad_pattern = 0;
+	if (query[0] == '\0') return;
+
+	Find.job = editor_search_start(query, Find.ignore_case, Find.regex);
+	Find.bad_pattern = Find.job == NULL;
+	editor_find_poll();
+}
+
+void editor_find() {
+	int saved_cx = Ed.view.cx;
+	int saved_cy = Ed.view.cy;
+	int saved_column_offset = Ed.view.column_offset;
+	int saved_row_offset = Ed.view.row_offset;
+
+	editor_find_set_prompt();
+	Find.current = -1;
+	char *query = editor_prompt(Find.prompt, editor_find_callback);
+	if (query) {
+		free(query);
+	} else {
+		Ed.view.cx = saved_cx;
+		Ed.view.cy = saved_cy;
+		Ed.view.column_offset = saved_column_offset;
+		Ed.view.row_offset = saved_row_offset;
+	}
+}
+
+// Append Buffer
+struct ABuf {
+	char *buffer;
+	int len;
+	int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+// Buffers grow geometrically, and the frame buffers below are kept across
+// refreshes, so a steady-state frame does no allocation at all.
+int abuf_allocations = 0;
+struct ABuf frame_buffer = ABUF_INIT;
+struct ABuf frame_line = ABUF_INIT;
+
+void abuf_append(struct ABuf *ab, const char *s, int len) {
+	if (ab -> len + len > ab -> cap) {
+		int cap = ab -> cap ? ab -> cap * 2 : 256;
+		while (cap < ab -> len + len) cap *= 2;
+
+		char *new = realloc(ab -> buffer, cap);
+		if (new == NULL) return;
+		ab -> buffer = new;
+		ab -> cap = cap;
+		abuf_allocations++;
+	}
+
+	memcpy(&ab -> buffer[ab -> len], s, len);
+	ab -> len += len;
+}
+
+void abuf_free(struct ABuf *ab) {
+	free(ab -> buffer);
+	ab -> buffer = NULL;
+	ab -> len = 0;
+	ab -> cap = 0;
+}
+
+// Screen
+// The last frame written is kept line by line, so a refresh only sends the
+// lines that differ from what the terminal already shows.
+void editor_screen_resize() {
+	for (int y = 0; y < Ed.screen_lines_len; y++) abuf_free(&Ed.screen_lines[y]);
+	free(Ed.screen_lines);
+
+	Ed.screen_lines_len = Ed.screen_rows + 2;
+	Ed.screen_lines = calloc(Ed.screen_lines_len, sizeof(struct ABuf));
+	if (Ed.screen_lines == NULL) die("calloc");
+	Ed.screen_valid = 0;
+}
+
+void editor_screen_line(struct ABuf *ab, int y, struct ABuf *line) {
+	struct ABuf *front = &Ed.screen_lines[y];
+	if (front -> len == line -> len && (line -> len == 0 || !memcmp(front -> buffer, line -> buffer, line -> len))) return;
+
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H\x1b[K", y + 1);
+	abuf_append(ab, buf, len);
+	abuf_append(ab, line -> buffer, line -> len);
+
+	front -> len = 0;
+	abuf_append(front, line -> buffer, line -> len);
+}
+
+// Moves the text area by delta rows with a scroll region, so only the rows
+// scrolled into view have to be sent.
+void editor_scroll_screen(struct ABuf *ab, int delta) {
+	int n = delta > 0 ? delta : -delta;
+	if (n >= Ed.screen_rows) return;
+
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", Ed.screen_rows, n, delta > 0 ? 'S' : 'T');
+	abuf_append(ab, buf, len);
+
+	struct ABuf saved[n];
+	if (delta > 0) {
+		memcpy(saved, Ed.screen_lines, sizeof(struct ABuf) * n);
+		memmove(Ed.screen_lines, &Ed.screen_lines[n], sizeof(struct ABuf) * (Ed.screen_rows - n));
+		memcpy(&Ed.screen_lines[Ed.screen_rows - n], saved, sizeof(struct ABuf) * n);
+		for (int y = Ed.screen_rows - n; y < Ed.screen_rows; y++) Ed.screen_lines[y].len = 0;
+	} else {
+		memcpy(saved, &Ed.screen_lines[Ed.screen_rows - n], sizeof(struct ABuf) * n);
+		memmove(&Ed.screen_lines[n], Ed.screen_lines, sizeof(struct ABuf) * (Ed.screen_rows - n));
+		memcpy(Ed.screen_lines, saved, sizeof(struct ABuf) * n);
+		for (int y = 0; y < n; y++) Ed.screen_lines[y].len = 0;
+	}
+}
+
+// View
+// DaveEd --view pages through a file read only, however big it is. Nothing
+// is read up front: a background thread indexes the file, keeping only the
+// offset of every DAVE_ED_VIEW_CHECKPOINT_LINES-th line start, and the
+// screen is drawn from a window of the file mapped around the top line, so
+// memory stays bounded by the window and the checkpoints.
+struct {
+	int active;
+	int fd;
+	off_t size;
+	pthread_t indexer;
+	off_t *checkpoints;
+	long long num_checkpoints;
+	long long checkpoints_cap;
+	off_t indexed;
+	long long indexed_lines;
+	int index_done;
+	char *window;
+	off_t window_start;
+	size_t window_len;
+	off_t top;
+	long long top_line;
+	int scrolled;
+	off_t *lines;
+	off_t *spare_lines;
+	int num_lines;
+	int lines_cap;
+} View;
+
+// Guards the index, which the indexer thread fills in as it goes.
+pthread_mutex_t view_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void editor_view_checkpoint(off_t offset) {
+	if (View.num_checkpoints == View.checkpoints_cap) {
+		View.checkpoints_cap = View.checkpoints_cap ? View.checkpoints_cap * 2 : 1024;
+		View.checkpoints = realloc(View.checkpoints, sizeof(off_t) * View.checkpoints_cap);
+		if (View.checkpoints == NULL) die("realloc");
+	}
+
+	View.checkpoints[View.num_checkpoints++] = offset;
+}
+
+void *editor_view_indexer(void *arg) {
+	(void) arg;
+	char *buffer = malloc(DAVE_ED_VIEW_READ);
+	off_t offset = 0;
+	long long lines = 0;
+	int reads = 0;
+
+	while (offset < View.size) {
+		ssize_t n = pread(View.fd, buffer, DAVE_ED_VIEW_READ, offset);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) break;
+
+		pthread_mutex_lock(&view_lock);
+		for (char *p = buffer; (p = memchr(p, '\n', buffer + n - p)); ) {
+			off_t start = offset + (++p - buffer);
+			if (start == View.size) break;
+			if (++lines % DAVE_ED_VIEW_CHECKPOINT_LINES == 0) editor_view_checkpoint(start);
+		}
+
+		offset += n;
+		View.indexed = offset;
+		View.indexed_lines = lines + 1;
+		pthread_mutex_unlock(&view_lock);
+
+		// Progress shows in the status bar, which needs no redraw per read.
+		if (++reads % 64 == 0) editor_wake('v');
+	}
+
+	pthread_mutex_lock(&view_lock);
+	View.index_done = 1;
+	pthread_mutex_unlock(&view_lock);
+	editor_wake('v');
+	free(buffer);
+
+	return NULL;
+}
+
+// Returns the file from offset on, moving the window when offset to
+// offset + len is not all inside it. len must be at most half a window.
+char *editor_view_map(off_t offset, size_t len) {
+	if (offset + (off_t) len > View.size) len = View.size - offset;
+	if (View.window && offset >= View.window_start && offset + len <= View.window_start + View.window_len)
+		return View.window + (offset - View.window_start);
+
+	if (View.window) munmap(View.window, View.window_len);
+
+	// A quarter of the window is kept behind offset for scrolling back up.
+	long page = sysconf(_SC_PAGESIZE);
+	off_t start = offset > DAVE_ED_VIEW_WINDOW / 4 ? offset - DAVE_ED_VIEW_WINDOW / 4 : 0;
+	start -= start % page;
+
+	View.window_start = start;
+	View.window_len = View.size - start < DAVE_ED_VIEW_WINDOW ? View.size - start : DAVE_ED_VIEW_WINDOW;
+	View.window = mmap(NULL, View.window_len, PROT_READ, MAP_PRIVATE, View.fd, start);
+	if (View.window == MAP_FAILED) die("mmap");
+
+	return View.window + (offset - start);
+}
+
+// Returns the start of the line after the one at offset, or the size of
+// the file when there is none.
+off_t editor_view_next_line(off_t offset) {
+	while (offset < View.size) {
+		size_t len = View.size - offset < DAVE_ED_VIEW_WINDOW / 2 ? View.size - offset : DAVE_ED_VIEW_WINDOW / 2;
+		char *s = editor_view_map(offset, len);
+		char *newline = memchr(s, '\n', len);
+		if (newline) return offset + (newline - s) + 1;
+
+		offset += len;
+	}
+
+	return View.size;
+}
+
+// As editor_view_next_line, but for a line the screen last showed, whose
+// end is already known.
+off_t editor_view_line_after(off_t offset) {
+	for (int k = 0; k + 1 < View.num_lines; k++)
+		if (View.lines[k] == offset) return View.lines[k + 1];
+
+	return editor_view_next_line(offset);
+}
+
+// Returns the start of the line holding offset.
+off_t editor_view_line_start(off_t offset) {
+	while (offset > 0) {
+		size_t len = offset < DAVE_ED_VIEW_WINDOW / 2 ? offset : DAVE_ED_VIEW_WINDOW / 2;
+		char *s = editor_view_map(offset - len, len);
+		char *newline = memrchr(s, '\n', len);
+		if (newline) return offset - len + (newline - s) + 1;
+
+		offset -= len;
+	}
+
+	return 0;
+}
+
+// Returns the number of the line starting at offset, counted on from the
+// checkpoint before it, or -1 when the index has not got that far yet.
+long long editor_view_line_number(off_t offset) {
+	pthread_mutex_lock(&view_lock);
+	if (offset > View.indexed || View.num_checkpoints == 0) {
+		pthread_mutex_unlock(&view_lock);
+
+		return View.size == 0 ? 0 : -1;
+	}
+
+	long long lo = 0, hi = View.num_checkpoints - 1;
+	while (lo < hi) {
+		long long mid = (lo + hi + 1) / 2;
+		if (View.checkpoints[mid] <= offset) lo = mid;
+		else hi = mid - 1;
+	}
+
+	off_t from = View.checkpoints[lo];
+	pthread_mutex_unlock(&view_lock);
+
+	long long line = lo * DAVE_ED_VIEW_CHECKPOINT_LINES;
+	while (from < offset) {
+		size_t len = offset - from < DAVE_ED_VIEW_WINDOW / 2 ? offset - from : DAVE_ED_VIEW_WINDOW / 2;
+		char *s = editor_view_map(from, len);
+		for (char *p = s; (p = memchr(p, '\n', s + len - p)); p++) line++;
+		from += len;
+	}
+
+	return line;
+}
+
+void editor_view_jump(off_t offset, long long line) {
+	View.top = offset;
+	View.top_line = line;
+	View.scrolled = Ed.screen_rows;
+}
+
+// Moves the top line by delta lines, as far as the file goes.
+void editor_view_scroll(int delta) {
+	for (; delta > 0; delta--) {
+		off_t next = editor_view_line_after(View.top);
+		if (next >= View.size) break;
+
+		View.top = next;
+		View.scrolled++;
+		if (View.top_line != -1) View.top_line++;
+	}
+
+	for (; delta < 0 && View.top > 0; delta++) {
+		View.top = editor_view_line_start(View.top - 1);
+		View.scrolled--;
+		if (View.top_line != -1) View.top_line--;
+	}
+}
+
+// Seeks through the checkpoints, so only the lines after the nearest one
+// are scanned.
+void editor_view_goto_line(long long line) {
+	if (View.size == 0) return;
+
+	pthread_mutex_lock(&view_lock);
+	long long known = View.indexed_lines;
+	int done = View.index_done;
+	if (line >= known && done) line = known - 1;
+	if (line < 0) line = 0;
+
+	if (line >= known) {
+		pthread_mutex_unlock(&view_lock);
+		editor_set_status_message("Only %lld lines indexed so far", known);
+
+		return;
+	}
+
+	off_t offset = View.checkpoints[line / DAVE_ED_VIEW_CHECKPOINT_LINES];
+	pthread_mutex_unlock(&view_lock);
+
+	for (long long k = line % DAVE_ED_VIEW_CHECKPOINT_LINES; k > 0; k--) offset = editor_view_next_line(offset);
+	editor_view_jump(offset, line);
+}
+
+// Goes to the first line starting at or after percent of the way through.
+void editor_view_goto_percent(int percent) {
+	if (View.size == 0) return;
+
+	off_t target = View.size * percent / 100;
+	off_t offset = target > 0 ? editor_view_next_line(target - 1) : 0;
+	if (offset >= View.size) offset = editor_view_line_start(View.size - 1);
+
+	editor_view_jump(offset, editor_view_line_number(offset));
+}
+
+void editor_view_goto_end() {
+	if (View.size == 0) return;
+
+	pthread_mutex_lock(&view_lock);
+	long long line = View.index_done ? View.indexed_lines - 1 : -1;
+	pthread_mutex_unlock(&view_lock);
+
+	editor_view_jump(editor_view_line_start(View.size - 1), line);
+	editor_view_scroll(-(Ed.screen_rows - 1));
+}
+
+void editor_view_goto() {
+	char *target = editor_prompt("Go to line or N%%: %s (ESC to Cancel)", NULL);
+	if (target == NULL) return;
+
+	char *end;
+	long long n = strtoll(target, &end, 10);
+	if (end == target || (*end && strcmp(end, "%"))) {
+		editor_set_status_message("Not a line number or percentage: %s", target);
+	} else if (*end == '%') {
+		editor_view_goto_percent(n < 0 ? 0 : n > 100 ? 100 : n);
+	} else {
+		editor_view_goto_line(n - 1);
+	}
+
+	free(target);
+}
+
+// Picks up indexing progress. Returns 1 when the screen needs redrawing.
+int editor_view_poll() {
+	if (!View.active) return 0;
+
+	if (View.top_line == -1) View.top_line = editor_view_line_number(View.top);
 
-	for (j = 0; j < Ed.num_rows; j++)
-		totlen += Ed.row[j].size + 1;
-	*bufferlen = totlen;
+	return 1;
+}
 
-	char *buf = malloc(totlen);
-	char *p = buf;
+int editor_view_status(char *buf, size_t size) {
+	pthread_mutex_lock(&view_lock);
+	long long lines = View.indexed_lines;
+	int done = View.index_done;
+	int percent = View.size ? View.indexed * 100 / View.size : 100;
+	pthread_mutex_unlock(&view_lock);
 
-	for (j = 0; j < Ed.num_rows; j++) {
-		memcpy(p, Ed.row[j].chars, Ed.row[j].size);
-		p += Ed.row[j].size;
-		*p = '\n';
-		p++;
-	}
+	char top[24] = "?";
+	if (View.top_line != -1) snprintf(top, sizeof(top), "%lld", View.top_line + 1);
 
-	return buf;
-}
+	if (done) return snprintf(buf, size, "Read Only | %s/%lld", top, lines);
 
-void editor_open(char *file_name) {
-	free(Ed.file_name);
-	Ed.file_name = strdup(file_name);
+	return snprintf(buf, size, "Indexing %d%% | %s/%lld+", percent, top, lines);
+}
 
-	editor_select_syntax_highlight();
+void editor_view_draw_line(struct ABuf *ab, const char *s, size_t len) {
+	int end = Ed.view.column_offset + Ed.screen_cols;
+	int col = 0;
+	for (size_t k = 0; k < len && col < end && s[k] != '\n'; k++) {
+		unsigned char c = s[k];
+		if (c == '\t') {
+			do {
+				if (col >= Ed.view.column_offset && col < end) abuf_append(ab, " ", 1);
+				col++;
+			} while (col % DAVE_ED_TAB_STOP != 0);
+
+			continue;
+		}
 
-	FILE *file_pointer = fopen(file_name, "r");
-	if (!file_pointer) die("fopen");
+		if (col++ < Ed.view.column_offset) continue;
 
-	char *line = NULL;
-	size_t line_cap = 0;
-	ssize_t line_len = 0;
-	while((line_len = getline(&line, &line_cap, file_pointer)) != -1) {
-		while (line_len > 0 && (line[line_len - 1] == '\n' ||
-								line[line_len - 1] == '\r' ))
-			line_len--;
+		if (iscntrl(c)) {
+			char sym = (c <= 26) ? '@' + c : '?';
 
-		editor_insert_row(Ed.num_rows, line, line_len);
+			abuf_append(ab, "\x1b[7m", 4);
+			abuf_append(ab, &sym, 1);
+			abuf_append(ab, "\x1b[m", 3);
+		} else {
+			abuf_append(ab, &s[k], 1);
+		}
 	}
-
-	free(line);
-	fclose(file_pointer);
-	Ed.unsaved_changes_flag = 0;
 }
 
-void editor_save() {
-	if (Ed.file_name == NULL) {
-		Ed.file_name = editor_prompt("Save as: %s (ESC to Cancel)", NULL);
-		if (Ed.file_name == NULL) {
-			editor_set_status_message("Save Aborted");
+// Returns the starts of the lines on screen, and of the one after. They
+// are kept from one frame to the next, and any the last frame had are
+// reused, so a line running on for gigabytes is scanned to its end once
+// as it comes into view rather than on every redraw.
+off_t *editor_view_screen_lines() {
+	int count = Ed.screen_rows + 1;
+	if (count > View.lines_cap) {
+		View.lines_cap = count;
+		View.lines = realloc(View.lines, sizeof(off_t) * count);
+		View.spare_lines = realloc(View.spare_lines, sizeof(off_t) * count);
+		if (View.lines == NULL || View.spare_lines == NULL) die("realloc");
+		View.num_lines = 0;
+	}
 
-			return;
-		}
+	off_t *lines = View.spare_lines;
+	int old = 0;
+	lines[0] = View.top;
+	for (int k = 1; k < count; k++) {
+		while (old < View.num_lines && View.lines[old] < lines[k - 1]) old++;
 
-		editor_select_syntax_highlight();
+		if (old + 1 < View.num_lines && View.lines[old] == lines[k - 1]) {
+			lines[k] = View.lines[old + 1];
+		} else {
+			lines[k] = lines[k - 1] < View.size ? editor_view_next_line(lines[k - 1]) : View.size;
+		}
 	}
 
-	int length = 0;
-	char *buffer = editor_rows_to_string(&length);
-	int fd = open(Ed.file_name, O_RDWR | O_CREAT, 0644);
+	View.spare_lines = View.lines;
+	View.lines = lines;
+	View.num_lines = count;
 
-	if (fd != -1) {
-		if (ftruncate(fd, length)  != -1) {
-			if (write(fd, buffer, length) == length) {
-				close(fd);
-				free(buffer);
-				Ed.unsaved_changes_flag = 0;
-				editor_set_status_message("%d Bytes Written to Disk", length);
+	return lines;
+}
 
-				return;
-			}
+// Every byte takes at least a column, so no more of a line than the
+// columns up to the right edge of the screen is ever needed. Scrolling
+// right stops where that would be more than editor_view_map can hand out
+// at once.
+void editor_view_draw_rows(struct ABuf *ab) {
+	struct ABuf *line = &frame_line;
+	size_t visible = Ed.view.column_offset + Ed.screen_cols;
+	if (visible > DAVE_ED_VIEW_WINDOW / 2) visible = DAVE_ED_VIEW_WINDOW / 2;
+	off_t *lines = editor_view_screen_lines();
+
+	for (int y = 0; y < Ed.screen_rows; y++) {
+		off_t offset = lines[y];
+		if (offset >= View.size) {
+			abuf_append(line, "*", 1);
+		} else {
+			size_t len = lines[y + 1] - offset < (off_t) visible ? (size_t) (lines[y + 1] - offset) : visible;
+			editor_view_draw_line(line, editor_view_map(offset, len), len);
 		}
 
-		close(fd);
+		editor_screen_line(ab, y, line);
+		line -> len = 0;
 	}
-
-	free(buffer);
-	editor_set_status_message("Unable to Save! I/O Error: %s", strerror(errno));
 }
 
-// Find
-void editor_find_callback(char *query, int key) {
-	static int last_match = -1;
-	static int direction = 1;
-	static int saved_highlighted_line = 0;
-	static char *saved_highlight = NULL;
+void editor_view_process_key(int c) {
+	switch (c) {
+		case 'q':
+		case CTRL_KEY('q'):
+			write(STDOUT_FILENO, "\x1b[2J", 4);
+			write(STDOUT_FILENO, "\x1b[H", 3);
+			exit(0);
+			break;
 
-	if (saved_highlight) {
-		memcpy(Ed.row[saved_highlighted_line].highlight, saved_highlight, Ed.row[saved_highlighted_line].rsize);
-		free(saved_highlight);
-		saved_highlight = NULL;
-	}
+		case ARROW_UP:
+		case ARROW_DOWN:
+			editor_view_scroll(c == ARROW_UP ? -1 : 1);
+			break;
 
-	if (key == '\r' || key == '\x1b') {
-		last_match = -1;
-		direction = 1;
-		return;
-	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-		direction = 1;
-	} else if (key == ARROW_LEFT || key == ARROW_UP) {
-		direction = -1;
-	} else {
-		last_match = -1;
-		direction = 1;
-	}
-
-	if (last_match == -1) direction = 1;
-	int current = last_match;
-	int i;
-	for (i = 0; i < Ed.num_rows; i++) {
-		current += direction;
-		if (current == -1) current = Ed.num_rows - 1;
-		else if (current == Ed.num_rows) current = 0;
-
-		rstore *row = &Ed.row[current];
-		char *match = strstr(row -> render, query);
-
-		if (match) {
-			last_match = current;
-			Ed.cy = current;
-			Ed.cx = editor_row_rx_to_cx(row, match - row -> render);
-			Ed.row_offset = Ed.num_rows;
-
-			saved_highlighted_line = current;
-			saved_highlight = malloc(row -> rsize);
-			memcpy(saved_highlight, row -> highlight, row -> rsize);
-			memset(&row -> highlight[match - row -> render], HL_MATCH, strlen(query));
+		case PAGE_UP:
+		case PAGE_DOWN:
+			editor_view_scroll(c == PAGE_UP ? -Ed.screen_rows : Ed.screen_rows);
 			break;
-		}
-	}
-}
 
-void editor_find() {
-	int saved_cx = Ed.cx;
-	int saved_cy = Ed.cy;
-	int saved_column_offset = Ed.column_offset;
-	int saved_row_offset = Ed.row_offset;
+		case ARROW_LEFT:
+			if (Ed.view.column_offset > 0) Ed.view.column_offset--;
+			break;
 
-	char *query = editor_prompt("Search: %s (ESC Cancel/Arrows/Enter Confirm)", editor_find_callback);
-	if (query) {
-		free(query);
-	} else {
-		Ed.cx = saved_cx;
-		Ed.cy = saved_cy;
-		Ed.column_offset = saved_column_offset;
-		Ed.row_offset = saved_row_offset;
-	}
-}
+		case ARROW_RIGHT:
+			if (Ed.view.column_offset + Ed.screen_cols < DAVE_ED_VIEW_WINDOW / 2) Ed.view.column_offset++;
+			break;
 
-// Append Buffer
-struct ABuf {
-	char *buffer;
-	int len;
-};
+		case HOME_KEY:
+			editor_view_jump(0, 0);
+			break;
 
-#define ABUF_INIT {NULL, 0}
+		case END_KEY:
+			editor_view_goto_end();
+			break;
 
-void abuf_append(struct ABuf *ab, const char *s, int len) {
-	char *new = realloc(ab -> buffer, ab -> len + len);
+		case 'g':
+		case CTRL_KEY('g'):
+			editor_view_goto();
+			break;
 
-	if (new == NULL) return;
-	memcpy(&new[ab -> len], s, len);
-	ab -> buffer = new;
-	ab -> len += len;
+		case CTRL_KEY('t'):
+			Ed.show_stats = !Ed.show_stats;
+			break;
+	}
 }
 
-void abuf_free(struct ABuf *ab) {
-	free(ab -> buffer);
+void editor_view_open(char *file_name) {
+	View.fd = open(file_name, O_RDONLY);
+	if (View.fd == -1) die("open");
+
+	struct stat st;
+	if (fstat(View.fd, &st) == -1) die("fstat");
+
+	Ed.buffer -> file_name = strdup(file_name);
+	View.active = 1;
+	View.size = st.st_size;
+	View.top_line = 0;
+	if (View.size > 0) {
+		editor_view_checkpoint(0);
+		View.indexed_lines = 1;
+	}
+
+	if (pthread_create(&View.indexer, NULL, editor_view_indexer, NULL) != 0) die("pthread_create");
 }
 
 // Output
 void editor_scroll() {
-	Ed.rx = 0;
-	if (Ed.cy < Ed.num_rows) {
-		Ed.rx = editor_row_cx_to_rx(&Ed.row[Ed.cy], Ed.cx);
+	Ed.view.rx = 0;
+	if (Ed.view.cy < Ed.buffer -> num_rows) {
+		Ed.view.rx = editor_row_cx_to_rx(editor_row(Ed.view.cy), Ed.view.cx);
 
 	}
 
-	if (Ed.cy < Ed.row_offset) {
-		Ed.row_offset = Ed.cy;
+	if (Ed.view.cy < Ed.view.row_offset) {
+		Ed.view.row_offset = Ed.view.cy;
 	}
 
-	if (Ed.cy >= Ed.row_offset + Ed.screen_rows) {
-		Ed.row_offset = Ed.cy - Ed.screen_rows + 1;
+	if (Ed.view.cy >= Ed.view.row_offset + Ed.screen_rows) {
+		Ed.view.row_offset = Ed.view.cy - Ed.screen_rows + 1;
 	}
 
-	if (Ed.rx < Ed.column_offset) {
-		Ed.column_offset = Ed.rx;
+	if (Ed.view.rx < Ed.view.column_offset) {
+		Ed.view.column_offset = Ed.view.rx;
 	}
 
-	if (Ed.rx >= Ed.column_offset + Ed.screen_cols) {
-		Ed.column_offset = Ed.rx - Ed.screen_cols + 1;
+	if (Ed.view.rx >= Ed.view.column_offset + Ed.screen_cols) {
+		Ed.view.column_offset = Ed.view.rx - Ed.screen_cols + 1;
 	}
 }
 
 void editor_draw_rows(struct ABuf *ab) {
+	if (View.active) {
+		editor_view_draw_rows(ab);
+
+		return;
+	}
+
+	editor_syntax_settle(Ed.view.row_offset + Ed.screen_rows);
+
+	rstore *row = editor_row(Ed.view.row_offset);
+	struct ABuf *line = &frame_line;
 	int y = 0;
 	for (y = 0; y < Ed.screen_rows; y++) {
-		int file_row = y + Ed.row_offset;
-		if (file_row >= Ed.num_rows){
-			if (Ed.num_rows == 0 && y == Ed.screen_rows  / 3) {
+		int file_row = y + Ed.view.row_offset;
+		if (file_row >= Ed.buffer -> num_rows){
+			if (Ed.buffer -> num_rows == 0 && y == Ed.screen_rows  / 3) {
 				char welcome[80];
 				int welcome_len = snprintf(welcome, sizeof(welcome), 
 					"DaveEd -- Version %s", DAVE_ED_VERSION);
@@ -766,74 +5743,122 @@ void editor_draw_rows(struct ABuf *ab) {
 				int padding = (Ed.screen_cols - welcome_len) / 2;
 
 				if (padding) {
-					abuf_append(ab, "*", 1);
+					abuf_append(line, "*", 1);
 					padding--;
 				}
 
-				while (padding--) abuf_append(ab, " ", 1);
+				while (padding--) abuf_append(line, " ", 1);
 
-				abuf_append(ab, welcome, welcome_len);
+				abuf_append(line, welcome, welcome_len);
 			} else {
-				abuf_append(ab, "*", 1);
+				abuf_append(line, "*", 1);
 			}
 		} else {
-			int length = Ed.row[file_row].rsize - Ed.column_offset;
-			if (length < 0) length = 0; 
-			if (length > Ed.screen_cols) length = Ed.screen_cols;
+			editor_row_prepare(row);
+
+			char *c;
+			unsigned char *highlight;
+			int length;
+			if (row -> chunks) {
+				length = editor_chunks_window(row, &c, &highlight);
+			} else if (!editor_row_is_ascii(row)) {
+				length = editor_row_window(row, &c, &highlight);
+			} else {
+				length = row -> rsize - Ed.view.column_offset;
+				if (length < 0) length = 0; 
+				if (length > Ed.screen_cols) length = Ed.screen_cols;
+
+				c = &row -> render[Ed.view.column_offset];
+				highlight = &row -> highlight[Ed.view.column_offset];
+			}
 
-			char *c = &Ed.row[file_row].render[Ed.column_offset];
-			unsigned char *highlight = &Ed.row[file_row].highlight[Ed.column_offset];
 			int current_color = -1;
 			int j = 0;
-			for (j = 0; j < length; j++) {
-				if (iscntrl(c[j])) {
+			while (j < length) {
+				if (iscntrl((unsigned char) c[j])) {
 					char sym = (c[j] <= 26) ? '@' + c[j] : '?';
 
-					abuf_append(ab, "\x1b[7m", 4);
-					abuf_append(ab, &sym, 1);
-					abuf_append(ab, "\x1b[m", 3);
+					abuf_append(line, "\x1b[7m", 4);
+					abuf_append(line, &sym, 1);
+					abuf_append(line, "\x1b[m", 3);
 
 					if (current_color != -1) {
 						char buf[16];
 						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
 
-						abuf_append(ab, buf, clen);
-					}
-				} else if (highlight[j] == HL_NORMAL) {
-					if (current_color != -1) {
-						abuf_append(ab, "\x1b[39m", 5);
-						current_color = -1;
+						abuf_append(line, buf, clen);
 					}
 
-					abuf_append(ab, &c[j], 1);
-				} else {
-					int color = editor_syntax_to_color(highlight[j]);
-					if (color != current_color) {
-						current_color = color;
+					j++;
+
+					continue;
+				}
+
+				int color = (highlight[j] == HL_NORMAL) ? -1 : editor_syntax_to_color(highlight[j]);
+				if (color != current_color) {
+					if (color == -1) {
+						abuf_append(line, "\x1b[39m", 5);
+					} else {
 						char buf[16];
 						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-						abuf_append(ab, buf, clen);
+						abuf_append(line, buf, clen);
 					}
-					
-					abuf_append(ab, &c[j], 1);
+
+					current_color = color;
 				}
+
+				// Append the whole run of same-colored text at once.
+				int run = j + 1;
+				while (run < length && !iscntrl((unsigned char) c[run]) &&
+					   (highlight[run] == HL_NORMAL ? -1 : editor_syntax_to_color(highlight[run])) == color)
+					run++;
+
+				abuf_append(line, &c[j], run - j);
+				j = run;
 			}
 
-			abuf_append(ab, "\x1b[39m", 5);
+			abuf_append(line, "\x1b[39m", 5);
+			row = editor_row_next(row);
 		}
 
-		abuf_append(ab, "\x1b[K", 3);
-		abuf_append(ab, "\r\n", 2);
+		editor_screen_line(ab, y, line);
+		line -> len = 0;
 	}
+
+	editor_render_cache_trim();
 }
 
 void editor_draw_status_bar(struct ABuf *ab) {
 	abuf_append(ab, "\x1b[7m", 4);
 
 	char status[80], rstatus[80];
-	int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", Ed.file_name ? Ed.file_name : "[No File Name]", Ed.num_rows, Ed.unsaved_changes_flag ? "(modified)" : "");
-	int rlen = snprintf(rstatus, sizeof(rstatus), ".%s File Type | %d/%d", Ed.syntax ? Ed.syntax -> file_type : "File Type Empty", Ed.cy + 1, Ed.num_rows);
+	char tag[32] = "";
+	if (Ed.num_buffers > 1) snprintf(tag, sizeof(tag), "[%d/%d] ", editor_buffer_index(Ed.buffer) + 1, Ed.num_buffers);
+	int len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s", tag, Ed.buffer -> file_name ? Ed.buffer -> file_name : "[No File Name]", Ed.buffer -> num_rows, Ed.buffer -> unsaved_changes_flag ? "(modified)" : "");
+	int rlen = snprintf(rstatus, sizeof(rstatus), ".%.20s File Type | %d/%d", Ed.buffer -> syntax ? Ed.buffer -> syntax -> file_type : "File Type Empty", Ed.view.cy + 1, Ed.buffer -> num_rows);
+	if (Find.active && Find.bad_pattern)
+		rlen = snprintf(rstatus, sizeof(rstatus), "Bad pattern | %d/%d", Ed.view.cy + 1, Ed.buffer -> num_rows);
+	else if (Find.active && Find.job && !Find.indexed)
+		rlen = snprintf(rstatus, sizeof(rstatus), "Searching... | %d/%d", Ed.view.cy + 1, Ed.buffer -> num_rows);
+	else if (Find.active && Find.job)
+		rlen = snprintf(rstatus, sizeof(rstatus), "Match %d of %d | %d/%d", Find.num_matches ? Find.current + 1 : 0, Find.num_matches, Ed.view.cy + 1, Ed.buffer -> num_rows);
+	if (View.active) {
+		len = snprintf(status, sizeof(status), "%.20s - view", Ed.buffer -> file_name);
+		rlen = editor_view_status(rstatus, sizeof(rstatus));
+	}
+	if (Ed.show_stats) {
+		double p50, p99;
+		editor_stats_latency(&p50, &p99);
+		len = snprintf(status, sizeof(status), "in %.2f hl %.2f draw %.2f out %.2f ms",
+					   Stats.frame_us[STATS_INPUT] / 1000.0, Stats.frame_us[STATS_SYNTAX] / 1000.0,
+					   Stats.frame_us[STATS_DRAW] / 1000.0, Stats.frame_us[STATS_WRITE] / 1000.0);
+		rlen = snprintf(rstatus, sizeof(rstatus), "p50 %.1f p99 %.1f ms | %d B | %d allocs",
+						p50, p99, Stats.frame_bytes, Ed.frame_allocations);
+	}
 
+	// snprintf gives the length it wanted, which may be more than it wrote.
+	if (len >= (int) sizeof(status)) len = sizeof(status) - 1;
+	if (rlen >= (int) sizeof(rstatus)) rlen = sizeof(rstatus) - 1;
 	if (len > Ed.screen_cols) len = Ed.screen_cols;
 	abuf_append(ab, status, len);
 
@@ -848,12 +5873,9 @@ void editor_draw_status_bar(struct ABuf *ab) {
 	}
 
 	abuf_append(ab, "\x1b[m", 3);
-	abuf_append(ab, "\r\n", 2);
 }
 
 void editor_draw_message_bar(struct ABuf *ab) {
-	abuf_append(ab, "\x1b[K", 3);
-
 	int message_length = strlen(Ed.status_message);
 
 	if (message_length > Ed.screen_cols) message_length = Ed. screen_cols;
@@ -862,25 +5884,53 @@ void editor_draw_message_bar(struct ABuf *ab) {
 }
 
 void editor_refresh_screen() {
-	editor_scroll();
-
-	struct ABuf ab = ABUF_INIT;
+	// The view has no cursor of its own, so it sits in the top left.
+	int scrolled;
+	if (View.active) {
+		scrolled = View.scrolled;
+		View.scrolled = 0;
+		Ed.view.rx = Ed.view.column_offset;
+	} else {
+		editor_scroll();
+		scrolled = Ed.view.row_offset - Ed.screen_row_offset;
+	}
 
-	abuf_append(&ab, "\x1b[?25l", 6);
-	abuf_append(&ab, "\x1b[H", 3);
+	struct ABuf *ab = &frame_buffer;
+	struct ABuf *line = &frame_line;
+	int allocations = abuf_allocations;
+	ab -> len = 0;
+	line -> len = 0;
+
+	abuf_append(ab, "\x1b[?25l", 6);
+	if (!Ed.screen_valid) {
+		abuf_append(ab, "\x1b[2J", 4);
+		for (int y = 0; y < Ed.screen_rows + 2; y++) Ed.screen_lines[y].len = 0;
+		Ed.screen_valid = 1;
+	} else if (scrolled) {
+		editor_scroll_screen(ab, scrolled);
+	}
+	Ed.screen_row_offset = Ed.view.row_offset;
 
-	editor_draw_rows(&ab);
-	editor_draw_status_bar(&ab);
-	editor_draw_message_bar(&ab);
+	long long start = editor_probe_start();
+	editor_draw_rows(ab);
+	editor_probe_end("draw_rows", start, STATS_DRAW);
+	editor_draw_status_bar(line);
+	editor_screen_line(ab, Ed.screen_rows, line);
+	line -> len = 0;
+	editor_draw_message_bar(line);
+	editor_screen_line(ab, Ed.screen_rows + 1, line);
 
 	char buffer[32];
-	snprintf(buffer, sizeof(buffer), "\x1b[%d;%dH", (Ed.cy - Ed.row_offset) + 1, 
-													(Ed.rx - Ed.column_offset) + 1);
-	abuf_append(&ab, buffer, strlen(buffer));
-	abuf_append(&ab, "\x1b[?25h", 6);
-
-	write(STDOUT_FILENO, ab.buffer, ab.len);
-	abuf_free(&ab);
+	int len = snprintf(buffer, sizeof(buffer), "\x1b[%d;%dH", (Ed.view.cy - Ed.view.row_offset) + 1, 
+															(Ed.view.rx - Ed.view.column_offset) + 1);
+	abuf_append(ab, buffer, len);
+	abuf_append(ab, "\x1b[?25h", 6);
+
+	start = editor_probe_start();
+	write(STDOUT_FILENO, ab -> buffer, ab -> len);
+	editor_probe_end("write", start, STATS_WRITE);
+	editor_stats_frame(ab -> len);
+	Ed.frame_allocations = abuf_allocations - allocations;
 }
 
 void editor_set_status_message(const char *fmt, ...) {
@@ -901,11 +5951,13 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
 
 	while(1) {
 		editor_set_status_message(prompt, buf);
-		editor_refresh_screen();
+		if (!editor_input_pending()) editor_refresh_screen();
 
 		int c = editor_read_key();
 		if (c == DELETE_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-			if (buflen != 0) buf[--buflen] = '\0';
+			// The whole of a UTF-8 sequence goes at once.
+			while (buflen != 0 && ((unsigned char) buf[--buflen] & 0xc0) == 0x80);
+			buf[buflen] = '\0';
 		} else if (c == '\x1b') {
 			editor_set_status_message("");
 			if (callback) callback(buf, c);
@@ -918,7 +5970,23 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
 				if (callback) callback(buf, c);
 				return buf;
 			}
-		} else if (!iscntrl(c) && c < 128) {
+		} else if (c == PASTE_START) {
+			size_t len;
+			char *text = editor_read_paste(&len);
+			for (size_t k = 0; k < len; k++) {
+				if (iscntrl((unsigned char) text[k])) continue;
+
+				if (buflen == bufsize - 1) {
+					bufsize *= 2;
+					buf = realloc(buf, bufsize);
+				}
+
+				buf[buflen++] = text[k];
+			}
+
+			buf[buflen] = '\0';
+			free(text);
+		} else if (!iscntrl(c) && c < 256) {
 			if (buflen == bufsize - 1) {
 				bufsize *= 2;
 				buf = realloc(buf, bufsize);
@@ -933,54 +6001,57 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
 }
 
 void editor_move_cursor(int key) {
-	rstore *row = (Ed.cy >= Ed.num_rows) ? NULL : &Ed.row[Ed.cy];
+	rstore *row = editor_row(Ed.view.cy);
 
 	switch (key) {
 	case ARROW_LEFT:
-		if (Ed.cx != 0) {
-			Ed.cx--;
-		} else if (Ed.cy > 0) {
-			Ed.cy--;
-			Ed.cx = Ed.row[Ed.cy].size;
+		if (Ed.view.cx != 0) {
+			Ed.view.cx = editor_row_prev_char(row, Ed.view.cx);
+		} else if (Ed.view.cy > 0) {
+			Ed.view.cy--;
+			Ed.view.cx = editor_row(Ed.view.cy) -> size;
 		}
 		
 		break;
 
 	case ARROW_RIGHT:
-		if (row && Ed.cx < row -> size) {
-			Ed.cx++;
-		} else if (row && Ed.cx == row -> size) {
-			Ed.cy++;
-			Ed.cx = 0;
+		if (row && Ed.view.cx < row -> size) {
+			Ed.view.cx = editor_row_next_char(row, Ed.view.cx);
+		} else if (row && Ed.view.cx == row -> size) {
+			Ed.view.cy++;
+			Ed.view.cx = 0;
 		}
 		
 		break;
 
 	case ARROW_UP:
-		if (Ed.cy != 0) {
-			Ed.cy--;
+		if (Ed.view.cy != 0) {
+			Ed.view.cy--;
 		}
 		
 		break;
 
 	case ARROW_DOWN:
-		if (Ed.cy < Ed.num_rows) {
-			Ed.cy++;
+		if (Ed.view.cy < Ed.buffer -> num_rows) {
+			Ed.view.cy++;
 		}
 		
 		break;
 	}
 
-	row = (Ed.cy >= Ed.num_rows) ? NULL : &Ed.row[Ed.cy];
+	row = editor_row(Ed.view.cy);
 	int row_length = row ? row -> size : 0;
-	if (Ed.cx > row_length) {
-		Ed.cx = row_length;
+	if (Ed.view.cx > row_length) {
+		Ed.view.cx = row_length;
 	}
+
+	if (row) Ed.view.cx = editor_row_char_start(row, Ed.view.cx);
 }
 
-void editor_process_keypress() {
+void editor_process_key(int c) {
 	static int quit_times = DAVE_ED_QUIT_WARNINGS;
-	int c = editor_read_key();
+	static int close_times = DAVE_ED_QUIT_WARNINGS;
+	editor_undo_begin_group();
 
 	switch(c) {
 		case '\r':
@@ -988,29 +6059,92 @@ void editor_process_keypress() {
 			break;
 
 		case CTRL_KEY('q'):
-			if (Ed.unsaved_changes_flag && quit_times > 0) {
-				editor_set_status_message("UNSAVED CHANGES!"
-										" Really Quit? Press Ctrl-Q %d more times.", quit_times);
+			if (editor_unsaved_buffers() && quit_times > 0) {
+				editor_set_status_message("UNSAVED CHANGES in %d buffers!"
+										" Really Quit? Press Ctrl-Q %d more times.", editor_unsaved_buffers(), quit_times);
 				quit_times--;
 
 				return;
 			}
+			for (int k = 0; k < Ed.num_buffers; k++) {
+				editor_buffer_show(Ed.buffers[k]);
+				editor_journal_discard();
+			}
 			write(STDOUT_FILENO, "\x1b[2J", 4);
 	      	write(STDOUT_FILENO, "\x1b[H", 3);
 			exit(0);
 			break;
 
+		case CTRL_KEY('w'):
+			if (Ed.buffer -> unsaved_changes_flag && close_times > 0) {
+				editor_set_status_message("UNSAVED CHANGES!"
+										" Really Close? Press Ctrl-W %d more times.", close_times);
+				close_times--;
+
+				return;
+			}
+			editor_buffer_close();
+			editor_set_status_message("");
+			break;
+
+		case CTRL_KEY('o'):
+			{
+				char *file_name = editor_prompt("Open: %s (ESC to Cancel)", NULL);
+				if (file_name == NULL) break;
+
+				int opened = editor_open_buffer(file_name);
+				if (opened == -1) {
+					editor_set_status_message("Can't open %s: %s", file_name, strerror(errno));
+				} else if (opened == 0) {
+					editor_journal_recover();
+				}
+
+				free(file_name);
+			}
+
+			break;
+
+		case CTRL_KEY('n'):
+			editor_buffer_cycle(1);
+			break;
+
+		case CTRL_KEY('p'):
+			editor_buffer_cycle(-1);
+			break;
+
+		case CTRL_KEY('b'):
+			editor_buffer_list();
+			break;
+
 		case CTRL_KEY('s'):
 			editor_save();
 			break;
 
+		case CTRL_KEY('z'):
+			editor_undo(0);
+			break;
+
+		case CTRL_KEY('y'):
+			editor_undo(1);
+			break;
+
+		case PASTE_START:
+			{
+				size_t len;
+				char *text = editor_read_paste(&len);
+				editor_insert_text(text, len);
+				free(text);
+			}
+
+			break;
+
 		case HOME_KEY:
-			Ed.cx = 0;
+			Ed.view.cx = 0;
 			break;
 
 		case END_KEY:
-			if (Ed.cy < Ed.num_rows)
-				Ed.cx = Ed.row[Ed.cy].size;
+			if (Ed.view.cy < Ed.buffer -> num_rows)
+				Ed.view.cx = editor_row(Ed.view.cy) -> size;
 			break;
 
 		case CTRL_KEY('f'):
@@ -1028,10 +6162,10 @@ void editor_process_keypress() {
 		case PAGE_DOWN:
 			{
 				if (c == PAGE_UP) {
-					Ed.cy = Ed.row_offset;
+					Ed.view.cy = Ed.view.row_offset;
 				} else if (c == PAGE_DOWN) {
-					Ed.cy = Ed.row_offset + Ed.screen_rows - 1;
-					if (Ed.cy > Ed.num_rows) Ed.cy = Ed.num_rows;
+					Ed.view.cy = Ed.view.row_offset + Ed.screen_rows - 1;
+					if (Ed.view.cy > Ed.buffer -> num_rows) Ed.view.cy = Ed.buffer -> num_rows;
 				}
 
 
@@ -1049,6 +6183,10 @@ void editor_process_keypress() {
 			editor_move_cursor(c);
 			break;
 
+		case CTRL_KEY('t'):
+			Ed.show_stats = !Ed.show_stats;
+			break;
+
 		case CTRL_KEY('l'):
 		case '\x1b':
 			break;
@@ -1059,40 +6197,382 @@ void editor_process_keypress() {
 	}
 
 	quit_times = DAVE_ED_QUIT_WARNINGS;
+	close_times = DAVE_ED_QUIT_WARNINGS;
+}
+
+void editor_process_keypress() {
+	int c = editor_read_key();
+	long long start = editor_probe_start();
+	if (Stats.key_time == 0) Stats.key_time = start;
+
+	if (View.active) {
+		editor_view_process_key(c);
+	} else {
+		editor_process_key(c);
+	}
+
+	editor_probe_end("keypress", start, STATS_INPUT);
+}
+
+// Script
+// With --script the editor runs without a terminal, applying one command per
+// line through the same paths keys take. Text arguments take backslash
+// escapes for newline, tab and backslash, and replace takes sed style
+// /old/new/ with an optional g.
+struct ScriptKey {
+	char *name;
+	int key;
+};
+
+struct ScriptKey script_keys[] = {
+	{ "up", ARROW_UP }, { "down", ARROW_DOWN }, { "left", ARROW_LEFT }, { "right", ARROW_RIGHT },
+	{ "home", HOME_KEY }, { "end", END_KEY }, { "pageup", PAGE_UP }, { "pagedown", PAGE_DOWN },
+	{ "newline", '\r' }, { "backspace", BACKSPACE }, { "delete", DELETE_KEY },
+	{ "undo", CTRL_KEY('z') }, { "redo", CTRL_KEY('y') },
+	{ "next-buffer", CTRL_KEY('n') }, { "previous-buffer", CTRL_KEY('p') },
+};
+
+#define SCRIPT_KEYS  (sizeof(script_keys) / sizeof(script_keys[0]))
+
+// Decodes s in place up to an unescaped delim, setting *len. Returns the
+// text after the delimiter, or NULL when it never comes.
+char *script_unescape(char *s, int delim, int *len) {
+	char *out = s, *start = s;
+	while (*s && *s != delim) {
+		if (*s == '\\' && s[1]) {
+			s++;
+			*out++ = *s == 'n' ? '\n' : *s == 't' ? '\t' : *s;
+		} else {
+			*out++ = *s;
+		}
+
+		s++;
+	}
+
+	char *rest = *s ? s + 1 : NULL;
+	*out = '\0';
+	*len = out - start;
+
+	return rest;
+}
+
+// Finds the next match after the cursor, wrapping around the end of the
+// buffer back to the cursor's own row. Returns 0 when there is none.
+int script_find(struct SearchQuery *query, struct SearchMatch *found) {
+	if (Ed.buffer -> num_rows == 0) return 0;
+
+	struct RegexSearch search, *regex = NULL;
+	if (query -> regex) {
+		regex_search_init(&search, query -> regex);
+		regex = &search;
+	}
+
+	int start_row = 0, start_col = 0;
+	if (Ed.view.cy < Ed.buffer -> num_rows) {
+		start_row = Ed.view.cy;
+		start_col = Ed.view.cx + 1;
+	}
+
+	int result = 0;
+	editor_rows_close_gap();
+	for (int k = 0; k <= Ed.buffer -> num_rows && !result; k++) {
+		int at = (start_row + k) % Ed.buffer -> num_rows;
+		int col = k == 0 ? start_col : 0;
+		char *s;
+		int len, match_len;
+
+		editor_row_text(at, &s, &len);
+		if (col > len) continue;
+		if (regex && !regex_find_starts(regex, s, len)) continue;
+
+		int match = editor_search_next(query, regex, s, len, col, &match_len);
+		if (match == -1 || (k == Ed.buffer -> num_rows && match >= start_col)) continue;
+
+		found -> row = at;
+		found -> col = match;
+		found -> len = match_len;
+		result = 1;
+	}
+
+	if (regex) regex_search_free(regex);
+
+	return result;
+}
+
+// Collects every match in the buffer, in order.
+struct SearchMatch *script_find_all(struct SearchQuery *query, int *count) {
+	struct RegexSearch search, *regex = NULL;
+	if (query -> regex) {
+		regex_search_init(&search, query -> regex);
+		regex = &search;
+	}
+
+	struct SearchMatch *matches = NULL;
+	int cap = 0;
+	struct RowCursor cursor;
+	char *s;
+	int len;
+
+	*count = 0;
+	editor_rows_close_gap();
+	editor_row_cursor_seek(&cursor, 0);
+	for (int at = 0; at < Ed.buffer -> num_rows && editor_row_cursor_next(&cursor, &s, &len); at++) {
+		if (regex && !regex_find_starts(regex, s, len)) continue;
+
+		int col = 0;
+		int match, match_len;
+		while (col <= len && (match = editor_search_next(query, regex, s, len, col, &match_len)) != -1) {
+			if (*count == cap) {
+				cap = cap ? cap * 2 : 64;
+				matches = realloc(matches, sizeof(struct SearchMatch) * cap);
+			}
+
+			matches[*count].row = at;
+			matches[*count].col = match;
+			matches[*count].len = match_len;
+			(*count)++;
+			col = match + (match_len ? match_len : 1);
+		}
+	}
+
+	if (regex) regex_search_free(regex);
+
+	return matches;
+}
+
+// Replacements go last to first, so those still to come keep their place
+// even when the new text brings newlines. The cursor ends after the first.
+void script_replace(struct SearchMatch *matches, int count, char *text, int len) {
+	for (int k = count - 1; k >= 0; k--) {
+		editor_row_delete_text(editor_row(matches[k].row), matches[k].col, matches[k].len);
+		Ed.view.cy = matches[k].row;
+		Ed.view.cx = matches[k].col;
+		editor_insert_text(text, len);
+	}
+}
+
+// Returns NULL once the command is done, or what went wrong.
+char *editor_script_command(char *line) {
+	char *arg = strchr(line, ' ');
+	if (arg) *arg++ = '\0';
+
+	editor_undo_begin_group();
+
+	for (unsigned int k = 0; k < SCRIPT_KEYS; k++) {
+		if (strcmp(line, script_keys[k].name)) continue;
+
+		int times = arg ? atoi(arg) : 1;
+		if (times < 0) return "bad count";
+
+		while (times--) editor_process_key(script_keys[k].key);
+
+		return NULL;
+	}
+
+	if (!strcmp(line, "goto")) {
+		int row = 0, col = 0;
+		if (arg == NULL || sscanf(arg, "%d %d", &row, &col) < 1) return "goto needs a line";
+
+		Ed.view.cy = row < 1 ? 0 : row - 1;
+		if (Ed.view.cy > Ed.buffer -> num_rows) Ed.view.cy = Ed.buffer -> num_rows;
+
+		int size = Ed.view.cy < Ed.buffer -> num_rows ? editor_row(Ed.view.cy) -> size : 0;
+		Ed.view.cx = col < 1 ? 0 : col - 1;
+		if (Ed.view.cx > size) Ed.view.cx = size;
+	} else if (!strcmp(line, "type") || !strcmp(line, "insert")) {
+		if (arg == NULL) return "missing text";
+
+		int len;
+		script_unescape(arg, '\0', &len);
+		if (line[0] == 'i') {
+			editor_insert_text(arg, len);
+		} else {
+			for (int k = 0; k < len; k++) editor_process_key(arg[k] == '\n' ? '\r' : (unsigned char) arg[k]);
+		}
+	} else if (!strcmp(line, "find") || !strcmp(line, "find-regex")) {
+		if (arg == NULL) return "missing pattern";
+
+		int len;
+		struct SearchQuery query;
+		struct SearchMatch match;
+		script_unescape(arg, '\0', &len);
+		if (editor_search_query_init(&query, arg, 0, line[4] == '-') == -1) return "bad pattern";
+
+		if (script_find(&query, &match)) {
+			Ed.view.cy = match.row;
+			Ed.view.cx = match.col;
+		} else {
+			editor_set_status_message("Not found: %s", arg);
+		}
+
+		editor_search_query_free(&query);
+	} else if (!strcmp(line, "replace") || !strcmp(line, "replace-regex")) {
+		if (arg == NULL || arg[0] == '\0') return "missing /old/new/";
+
+		int delim = arg[0];
+		int pattern_len, text_len;
+		char *pattern = arg + 1;
+		char *text = script_unescape(pattern, delim, &pattern_len);
+		char *flags = text ? script_unescape(text, delim, &text_len) : NULL;
+		if (flags == NULL) return "replace needs /old/new/";
+		if (flags[0] && strcmp(flags, "g")) return "unknown replace flag";
+
+		struct SearchQuery query;
+		if (editor_search_query_init(&query, pattern, 0, line[7] == '-') == -1) return "bad pattern";
+
+		struct SearchMatch one, *matches = &one;
+		int count = 0;
+		if (flags[0] == 'g') {
+			matches = script_find_all(&query, &count);
+		} else {
+			count = script_find(&query, &one);
+		}
+
+		script_replace(matches, count, text, text_len);
+		editor_set_status_message("Replaced %d", count);
+		if (matches != &one) free(matches);
+		editor_search_query_free(&query);
+	} else if (!strcmp(line, "open")) {
+		if (arg == NULL) return "open needs a file name";
+		if (editor_open_buffer(arg) == -1) return "cannot read file";
+
+		Ed.buffer -> journal.suspended = 1;
+	} else if (!strcmp(line, "close")) {
+		editor_buffer_close();
+		Ed.buffer -> journal.suspended = 1;
+	} else if (!strcmp(line, "save")) {
+		if (arg) {
+			free(Ed.buffer -> file_name);
+			Ed.buffer -> file_name = strdup(arg);
+			editor_select_syntax_highlight();
+		}
+
+		if (Ed.buffer -> file_name == NULL) return "save needs a file name";
+
+		editor_save();
+	} else {
+		return "unknown command";
+	}
+
+	return NULL;
+}
+
+int editor_run_script(char *script, char *file_name) {
+	FILE *file_pointer = strcmp(script, "-") ? fopen(script, "r") : stdin;
+	if (!file_pointer) die("fopen");
+
+	Ed.headless = 1;
+	init_editor();
+	if (file_name && editor_open_buffer(file_name) == -1) die("open");
+
+	// A script can simply be run again, so it is not journaled.
+	Ed.buffer -> journal.suspended = 1;
+
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t line_len;
+	int line_number = 0, status = 0;
+
+	while ((line_len = getline(&line, &line_cap, file_pointer)) != -1) {
+		line_number++;
+		while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) line[--line_len] = '\0';
+		if (line_len == 0 || line[0] == '#') continue;
+
+		Ed.status_message[0] = '\0';
+		char *error = editor_script_command(line);
+		if (error) {
+			fprintf(stderr, "%s:%d: %s\n", script, line_number, error);
+			status = 1;
+			break;
+		}
+
+		if (Ed.status_message[0]) fprintf(stderr, "%s\n", Ed.status_message);
+
+		editor_scroll();
+	}
+
+	free(line);
+	if (file_pointer != stdin) fclose(file_pointer);
+
+	return status;
 }
 
 // Init
 void init_editor() {
-	Ed.cx = 0;
-	Ed.cy = 0;
-	Ed.rx = 0;
-	Ed.row_offset = 0;
-	Ed.column_offset = 0;
-	Ed.num_rows = 0;
-	Ed.row = NULL;
-	Ed.unsaved_changes_flag = 0;
-	Ed.file_name = NULL;
+	editor_init_seperators();
+	Ed.buffer = NULL;
+	Ed.buffers = NULL;
+	Ed.num_buffers = 0;
+	Ed.render_cache = NULL;
+	Ed.render_cache_len = 0;
+	Ed.render_cache_cap = 0;
+	Ed.screen_lines = NULL;
+	Ed.screen_lines_len = 0;
+	Ed.screen_valid = 0;
+	Ed.screen_row_offset = 0;
+	Ed.frame_allocations = 0;
+	Ed.show_stats = 0;
 	Ed.status_message[0] = '\0';
 	Ed.status_message_time = 0;
-	Ed.syntax = NULL;
+	editor_buffer_show(editor_buffer_new());
+	editor_load_syntaxes();
+
+	// Without a terminal the cursor still scrolls a standard sized screen,
+	// so paging behaves the same, but nothing is ever drawn.
+	if (Ed.headless) {
+		Ed.screen_rows = 24 - 2;
+		Ed.screen_cols = 80;
+
+		return;
+	}
 
 	if (get_window_size(&Ed.screen_rows, &Ed.screen_cols) == -1) die("get_window_size");
 	Ed.screen_rows -= 2;
+	editor_screen_resize();
+	editor_init_events();
 }
 
+#ifndef DAVE_ED_NO_MAIN
 int main(int argc, char *argv[]) {
+	Ed.program = argv[0];
+	if (argc >= 3 && !strcmp(argv[1], "--trace")) {
+		editor_trace_open(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc >= 3 && !strcmp(argv[1], "--script"))
+		return editor_run_script(argv[2], argc >= 4 ? argv[3] : NULL);
+
 	enable_raw_mode();
 	init_editor();
-	if (argc >= 2) {
-		editor_open(argv[1]);
-	}
+	if (argc >= 3 && !strcmp(argv[1], "--view")) {
+		editor_view_open(argv[2]);
+		editor_set_status_message("HELP: q to Quit | g = Go to Line or %% | Arrows/PgUp/PgDn/Home/End to Move");
+	} else {
+		// A syntax definition that would not load has its say first.
+		if (!Ed.status_message[0])
+			editor_set_status_message("HELP: Ctrl-S to Save | Ctrl-Q to Quit | Ctrl-F = Find | Ctrl-Z/Y = Undo/Redo");
+		for (int k = 1; k < argc; k++) {
+			int opened = editor_open_buffer(argv[k]);
+			if (opened == -1) die("open");
+			if (opened == 0) editor_journal_recover();
+		}
 
-	editor_set_status_message("HELP: Ctrl-S to Save | Ctrl-Q to Quit | Ctrl-F = Find");
+		if (Ed.num_buffers > 1) editor_buffer_show(Ed.buffers[0]);
+	}
 
+	// Keys that arrive together are all handled before the next frame,
+	// though a long burst still gets a frame every DAVE_ED_FRAME_BUDGET_MS.
 	while (1) {
 		editor_refresh_screen();
-		editor_process_keypress();
+
+		long long frame_start = editor_now_ms();
+		do {
+			editor_process_keypress();
+		} while (editor_input_pending() && editor_now_ms() - frame_start < DAVE_ED_FRAME_BUDGET_MS);
 	}
 
 	return 0;
 }
+#endif